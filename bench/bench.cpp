@@ -0,0 +1,264 @@
+// Times the kalang programs listed in workloads.txt three ways: JIT'd in
+// process, compiled ahead of time from the dumped IR, and as the equivalent C
+// function. Both AOT and C go through the same compiler at -O2, so the ratios
+// show how good the IR kalang hands to LLVM is.
+//
+// usage: kalang-bench [--cc clang] [--reps N] [--out results.json] <bench dir>
+
+#include "runtime.hpp"
+#include "parser.hpp"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using KalangFn = int (*)(int);
+
+struct Workload
+{
+  std::string program;
+  std::string function;
+  int arg;
+};
+
+struct Timing
+{
+  bool ok = false;
+  double seconds = 0;
+  int result = 0;
+};
+
+static std::vector<Workload> readWorkloads(const std::string& dir)
+{
+  std::vector<Workload> workloads;
+  std::ifstream in(dir + "/workloads.txt");
+  std::string line;
+  while(std::getline(in, line))
+  {
+    if(line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    std::istringstream fields(line);
+    Workload w;
+    if(fields >> w.program >> w.function >> w.arg)
+    {
+      workloads.push_back(w);
+    }
+  }
+  return workloads;
+}
+
+// best of reps calls
+static Timing timeCalls(KalangFn fn, int arg, unsigned reps)
+{
+  Timing t;
+  t.ok = true;
+  for(unsigned i = 0; i < reps; ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+    t.result = fn(arg);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if(i == 0 || elapsed.count() < t.seconds)
+    {
+      t.seconds = elapsed.count();
+    }
+  }
+  return t;
+}
+
+// compile the program with a fresh JIT, leaving its IR in TheProgram
+static KalangFn jitProgram(const std::string& path, const std::string& function)
+{
+  TheJIT = ExitOnErr(llvm::orc::KalangJIT::Create());
+  FunctionProtos.clear();
+  InitializeModule();
+  InitializeProgram();
+
+  Parser parser;
+  parser.read_file(path.c_str());
+  parser.parse();
+
+  auto sym = TheJIT->lookup(function);
+  if(!sym)
+  {
+    llvm::logAllUnhandledErrors(sym.takeError(), llvm::errs(), "kalang-bench: ");
+    return nullptr;
+  }
+  return (KalangFn)(intptr_t)sym->getAddress();
+}
+
+static void* buildShared(const std::string& cc, const std::string& source, const std::string& output)
+{
+  std::string cmd = cc + " -O2 -fwrapv -shared -fPIC -o " + output + " " + source;
+  if(system(cmd.c_str()) != 0)
+  {
+    fprintf(stderr, "kalang-bench: failed: %s\n", cmd.c_str());
+    return nullptr;
+  }
+  void* handle = dlopen(output.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if(!handle)
+  {
+    fprintf(stderr, "kalang-bench: %s\n", dlerror());
+  }
+  return handle;
+}
+
+static Timing timeShared(void* handle, const Workload& w, unsigned reps)
+{
+  if(!handle)
+  {
+    return Timing();
+  }
+  auto fn = (KalangFn)dlsym(handle, w.function.c_str());
+  if(!fn)
+  {
+    fprintf(stderr, "kalang-bench: %s not found\n", w.function.c_str());
+    return Timing();
+  }
+  return timeCalls(fn, w.arg, reps);
+}
+
+static std::string ratio(const Timing& t, const Timing& base)
+{
+  if(!t.ok || !base.ok || base.seconds <= 0)
+  {
+    return "n/a";
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", t.seconds / base.seconds);
+  return buf;
+}
+
+static std::string seconds(const Timing& t)
+{
+  if(!t.ok)
+  {
+    return "n/a";
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.6f", t.seconds);
+  return buf;
+}
+
+static std::string json(const Timing& t)
+{
+  if(!t.ok)
+  {
+    return "null";
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"seconds\": %.9f, \"result\": %d}", t.seconds, t.result);
+  return buf;
+}
+
+int main(int argc, char** argv)
+{
+  std::string cc = getenv("CC") ? getenv("CC") : "clang";
+  std::string out;
+  std::string dir;
+  unsigned reps = 5;
+  for(int i = 1; i < argc; ++i)
+  {
+    if(strcmp(argv[i], "--cc") == 0 && i + 1 < argc)
+    {
+      cc = argv[++i];
+    }
+    else if(strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+    {
+      reps = std::max(1, atoi(argv[++i]));
+    }
+    else if(strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+    {
+      out = argv[++i];
+    }
+    else
+    {
+      dir = argv[i];
+    }
+  }
+  if(dir.empty())
+  {
+    printf("usage: kalang-bench [--cc clang] [--reps N] [--out results.json] <bench dir>\n");
+    return 1;
+  }
+
+  auto workloads = readWorkloads(dir);
+  if(workloads.empty())
+  {
+    printf("Error: no workloads in %s/workloads.txt\n", dir.c_str());
+    return 1;
+  }
+
+  llvm::SmallString<128> work;
+  if(llvm::sys::fs::createUniqueDirectory("kalang-bench", work))
+  {
+    printf("Error: could not create a work directory\n");
+    return 1;
+  }
+
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+
+  std::string results = "[\n";
+  bool mismatch = false;
+  printf("%-10s %12s %12s %12s %8s %8s\n", "program", "jit (s)", "aot (s)", "c (s)", "jit/c", "aot/c");
+  for(unsigned n = 0; n < workloads.size(); ++n)
+  {
+    const Workload& w = workloads[n];
+    std::string base = dir + "/programs/" + w.program;
+    std::string scratch = std::string(work.str()) + "/" + w.program;
+
+    Timing jit;
+    if(auto fn = jitProgram(base + ".k", w.function))
+    {
+      jit = timeCalls(fn, w.arg, reps);
+    }
+
+    std::error_code EC;
+    llvm::raw_fd_ostream ir(scratch + ".ll", EC);
+    ir << *TheProgram;
+    ir.close();
+    Timing aot = timeShared(buildShared(cc, scratch + ".ll", scratch + ".aot.so"), w, reps);
+    Timing c = timeShared(buildShared(cc, base + ".c", scratch + ".c.so"), w, reps);
+
+    for(const Timing* t : {&jit, &aot})
+    {
+      if(t->ok && c.ok && t->result != c.result)
+      {
+        printf("Error: %s returned %d, the C baseline %d\n", w.program.c_str(), t->result, c.result);
+        mismatch = true;
+      }
+    }
+
+    printf("%-10s %12s %12s %12s %8s %8s\n", w.program.c_str(),
+      seconds(jit).c_str(), seconds(aot).c_str(), seconds(c).c_str(),
+      ratio(jit, c).c_str(), ratio(aot, c).c_str());
+    results += "  {\"program\": \"" + w.program + "\", \"function\": \"" + w.function +
+      "\", \"arg\": " + std::to_string(w.arg) + ", \"jit\": " + json(jit) +
+      ", \"aot\": " + json(aot) + ", \"c\": " + json(c) + "}";
+    results += n + 1 < workloads.size() ? ",\n" : "\n";
+  }
+  results += "]\n";
+
+  if(!out.empty())
+  {
+    std::ofstream file(out);
+    file << results;
+    printf("results written to %s\n", out.c_str());
+  }
+  llvm::sys::fs::remove_directories(work);
+  return mismatch ? 1 : 0;
+}
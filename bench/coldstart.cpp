@@ -0,0 +1,129 @@
+// Measures what starting kalang costs per invocation: runs it on an empty
+// file, with and without --emit-llvm, and on a one line program, and compares
+// each against starting `true`, a process that does nothing.
+//
+// usage: kalang-coldstart <kalang binary> [runs]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// run argv with its output discarded, returns the wall time in milliseconds
+// or a negative value if it failed
+static double runOnce(const std::vector<const char*>& argv)
+{
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if(pid == 0)
+  {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    std::vector<const char*> args(argv);
+    args.push_back(nullptr);
+    execvp(args[0], const_cast<char* const*>(args.data()));
+    _exit(127);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? ms : -1;
+}
+
+// median and minimum over runs, the median of a few dozen runs is stable
+// enough to compare, the minimum shows the cost without scheduling noise
+static bool measure(const std::vector<const char*>& argv, int runs, double& median, double& best)
+{
+  std::vector<double> times;
+  for(int i = 0; i < runs; ++i)
+  {
+    double ms = runOnce(argv);
+    if(ms < 0)
+    {
+      return false;
+    }
+    times.push_back(ms);
+  }
+  std::sort(times.begin(), times.end());
+  median = times[times.size() / 2];
+  best = times.front();
+  return true;
+}
+
+static bool writeFile(const char* path, const char* text)
+{
+  FILE* out = fopen(path, "w");
+  if(!out)
+  {
+    return false;
+  }
+  fputs(text, out);
+  fclose(out);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2 || argc > 3)
+  {
+    printf("usage: kalang-coldstart <kalang binary> [runs]\n");
+    return 1;
+  }
+  const char* kalang = argv[1];
+  int runs = argc == 3 ? atoi(argv[2]) : 50;
+  if(runs <= 0)
+  {
+    printf("Error: runs must be positive\n");
+    return 1;
+  }
+
+  const char* empty = "kalang-coldstart-empty.k";
+  const char* one = "kalang-coldstart-one.k";
+  if(!writeFile(empty, "") || !writeFile(one, "fungsi f(x) x + 1;\nf(41);\n"))
+  {
+    printf("Error: could not write the programs to run\n");
+    return 1;
+  }
+
+  struct Case
+  {
+    const char* name;
+    std::vector<const char*> argv;
+  };
+  std::vector<Case> cases = {
+    {"true", {"true"}},
+    {"empty file", {kalang, empty}},
+    {"empty file, --emit-llvm", {kalang, "--emit-llvm", empty}},
+    {"one definition, one call", {kalang, one}},
+    {"same, --emit-llvm", {kalang, "--emit-llvm", one}},
+  };
+
+  printf("%-26s %10s %10s %10s\n", "", "median ms", "min ms", "over true");
+  double baseline = 0;
+  bool failed = false;
+  for(auto& c : cases)
+  {
+    double median, best;
+    if(!measure(c.argv, runs, median, best))
+    {
+      printf("%-26s failed\n", c.name);
+      failed = true;
+      continue;
+    }
+    if(c.argv[0] == std::string("true"))
+    {
+      baseline = median;
+    }
+    printf("%-26s %10.2f %10.2f %10.2f\n", c.name, median, best, median - baseline);
+    fflush(stdout);
+  }
+  unlink(empty);
+  unlink(one);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,148 @@
+// Measures how fast the lexer classifies the characters of generated sources,
+// and turns them into tokens, with each level of SIMD scanning the CPU
+// supports, next to copying the same bytes with memcpy. Checks that every
+// level produces the same tokens.
+//
+// usage: kalang-lexbench [megabytes]   (8 by default)
+//
+// sources:
+//   terms   one long expression of short numbers and operators
+//   idents  calls with long names and arguments
+//   indent  deeply indented lines, mostly whitespace
+
+#include "charscan.hpp"
+#include "parser.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static std::string generate(const std::string& shape, size_t size)
+{
+  std::string source;
+  source.reserve(size + 256);
+  for(long i = 0; source.size() < size; ++i)
+  {
+    if(shape == "terms")
+    {
+      source += std::to_string(i % 97) + " + ";
+    }
+    else if(shape == "idents")
+    {
+      source += "computeTheAverageOfSamples" + std::to_string(i % 13) +
+        "(firstArgumentValue, secondArgumentValue, " + std::to_string(i) + ");\n";
+    }
+    else
+    {
+      source += std::string(4 + i % 40, ' ') + "x = x + 1\n" + std::string(i % 3, '\t');
+    }
+  }
+  return source + "1;\n";
+}
+
+// lex source to the end, returning the number of tokens and a checksum of
+// their kinds and values
+static void lex(const std::string& source, size_t& tokens, uint64_t& checksum)
+{
+  Parser parser;
+  parser.read_source(source);
+  tokens = 0;
+  checksum = 0;
+  for(Token token = parser.advanceToken(); token != tok_eof; token = parser.advanceToken())
+  {
+    ++tokens;
+    checksum = checksum * 31 + token;
+  }
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+  size_t megabytes = argc > 1 ? atol(argv[1]) : 8;
+  std::vector<ScanLevel> levels = {ScanLevel::Scalar};
+  if(bestScanLevel() >= ScanLevel::SSE2)
+  {
+    levels.push_back(ScanLevel::SSE2);
+  }
+  if(bestScanLevel() >= ScanLevel::AVX2)
+  {
+    levels.push_back(ScanLevel::AVX2);
+  }
+
+  bool mismatch = false;
+  printf("%-8s %-9s %10s", "source", "", "memcpy");
+  for(auto level : levels)
+  {
+    printf(" %10s", scanLevelName(level));
+  }
+  printf("   (MB/s)\n");
+  for(const char* shape : {"terms", "idents", "indent"})
+  {
+    std::string source = generate(shape, megabytes << 20);
+    double mb = source.size() / double(1 << 20);
+
+    std::vector<char> copy(source.size());
+    auto start = std::chrono::steady_clock::now();
+    memcpy(copy.data(), source.data(), source.size());
+    double copySeconds = seconds(start);
+
+    // the best of three runs, of classifying only and of lexing everything
+    std::vector<double> classifyBest(levels.size()), lexBest(levels.size());
+    size_t firstTokens = 0;
+    uint64_t firstChecksum = 0;
+    for(size_t i = 0; i < levels.size(); ++i)
+    {
+      useScanLevel(levels[i]);
+      for(int run = 0; run < 3; ++run)
+      {
+        CharClasses classes;
+        start = std::chrono::steady_clock::now();
+        classes.classify(source.data(), source.size());
+        double elapsed = seconds(start);
+        classifyBest[i] = run == 0 || elapsed < classifyBest[i] ? elapsed : classifyBest[i];
+
+        size_t tokens;
+        uint64_t checksum;
+        start = std::chrono::steady_clock::now();
+        lex(source, tokens, checksum);
+        elapsed = seconds(start);
+        lexBest[i] = run == 0 || elapsed < lexBest[i] ? elapsed : lexBest[i];
+        if(i == 0 && run == 0)
+        {
+          firstTokens = tokens;
+          firstChecksum = checksum;
+        }
+        else if(tokens != firstTokens || checksum != firstChecksum)
+        {
+          mismatch = true;
+        }
+      }
+    }
+
+    printf("%-8s %-9s %10.0f", shape, "classify", mb / copySeconds);
+    for(double best : classifyBest)
+    {
+      printf(" %10.0f", mb / best);
+    }
+    printf("\n%-8s %-9s %10s", "", "lex", "");
+    for(double best : lexBest)
+    {
+      printf(" %10.0f", mb / best);
+    }
+    printf("\n");
+  }
+  useScanLevel(bestScanLevel());
+  if(mismatch)
+  {
+    printf("Error: the levels disagree on the tokens\n");
+    return 1;
+  }
+  return 0;
+}
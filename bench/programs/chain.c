@@ -0,0 +1,17 @@
+static int k(int a, int b) { return a + b; }
+static int lqwmelwe(void) { return 5 - 2; }
+static int add(int x, int y) { return x + y; }
+static int xmain(int x) { return add(5, 2) + x; }
+static int f(int x) { return 1 + 2 + add(x, 1) + k(x, lqwmelwe()) + xmain(x); }
+
+int chain(int n)
+{
+  unsigned s = 0;
+  int i = 0;
+  do
+  {
+    s = s + (unsigned)f(i);
+    i++;
+  } while(i < n);
+  return (int)s;
+}
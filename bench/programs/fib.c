@@ -0,0 +1,4 @@
+int fib(int x)
+{
+  return x < 3 ? 1 : fib(x - 1) + fib(x - 2);
+}
@@ -0,0 +1,13 @@
+int fibi(int x)
+{
+  unsigned a = 1, b = 1;
+  int i = 3;
+  do
+  {
+    unsigned c = a + b;
+    a = b;
+    b = c;
+    i++;
+  } while(i < x);
+  return (int)b;
+}
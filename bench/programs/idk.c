@@ -0,0 +1,11 @@
+int idk(int x)
+{
+  unsigned a = 1, b = 1;
+  int i = 1;
+  do
+  {
+    b = a + b;
+    i++;
+  } while(i < x);
+  return (int)b;
+}
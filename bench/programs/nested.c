@@ -0,0 +1,16 @@
+int nested(int n)
+{
+  unsigned s = 0;
+  int i = 0;
+  do
+  {
+    int j = 0;
+    do
+    {
+      s = s + (j < i ? (unsigned)i * (unsigned)j : (unsigned)(j - i));
+      j++;
+    } while(j < n);
+    i++;
+  } while(i < n);
+  return (int)s;
+}
@@ -0,0 +1,170 @@
+// Generates kalang programs of growing size and measures how long kalang takes
+// to compile them and how much memory it needs, to catch compile paths that
+// grow faster than the input.
+//
+// usage: kalang-scale --gen <shape> <n>            print one program
+//        kalang-scale <kalang binary> <shape> <n>...  time kalang on each size
+//
+// shapes:
+//   defs   n functions, each calling the one before
+//   nest   one function whose body is n nested parentheses
+//   vars   one function binding n variables in a single var
+//   scopes one function with n nested vars, each shadowing the outer ones
+//   terms  one expression with n additions
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+static bool generate(const std::string& shape, long n, FILE* out)
+{
+  if(shape == "defs")
+  {
+    fprintf(out, "fungsi f0(x) x + 1;\n");
+    for(long i = 1; i < n; ++i)
+    {
+      fprintf(out, "fungsi f%ld(x) f%ld(x) + 1;\n", i, i - 1);
+    }
+    fprintf(out, "f%ld(0);\n", n - 1);
+  }
+  else if(shape == "nest")
+  {
+    fprintf(out, "fungsi deep(x) ");
+    for(long i = 0; i < n; ++i)
+    {
+      fputc('(', out);
+    }
+    fprintf(out, "x");
+    for(long i = 0; i < n; ++i)
+    {
+      fprintf(out, " + 1)");
+    }
+    fprintf(out, ";\ndeep(0);\n");
+  }
+  else if(shape == "vars")
+  {
+    fprintf(out, "fungsi many(x)\n  var v0 = x");
+    for(long i = 1; i < n; ++i)
+    {
+      fprintf(out, ",\n    v%ld = v%ld + 1", i, i - 1);
+    }
+    fprintf(out, "\n  in (v%ld = v%ld + 1) : v%ld;\nmany(0);\n", n - 1, n - 1, n - 1);
+  }
+  else if(shape == "scopes")
+  {
+    fprintf(out, "fungsi nested(x)\n");
+    for(long i = 0; i < n; ++i)
+    {
+      fprintf(out, "  var x = x + 1, y%ld = x in (\n", i);
+    }
+    fprintf(out, "  x");
+    for(long i = n - 1; i >= 0; --i)
+    {
+      fprintf(out, ") : x + y%ld", i);
+    }
+    fprintf(out, ";\nnested(0);\n");
+  }
+  else if(shape == "terms")
+  {
+    fprintf(out, "1");
+    for(long i = 1; i < n; ++i)
+    {
+      fprintf(out, " + %ld", i % 7);
+    }
+    fprintf(out, ";\n");
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// run kalang on path with its output discarded, returns false if it failed
+static bool measure(const char* kalang, const std::string& path, double& seconds, long& maxRssKb)
+{
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if(pid == 0)
+  {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    execl(kalang, kalang, path.c_str(), (char*)nullptr);
+    _exit(127);
+  }
+  int status = 0;
+  struct rusage usage;
+  wait4(pid, &status, 0, &usage);
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  maxRssKb = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc == 4 && strcmp(argv[1], "--gen") == 0)
+  {
+    if(!generate(argv[2], atol(argv[3]), stdout))
+    {
+      printf("Error: unknown shape %s\n", argv[2]);
+      return 1;
+    }
+    return 0;
+  }
+  if(argc < 4)
+  {
+    printf("usage: kalang-scale --gen <shape> <n>\n");
+    printf("       kalang-scale <kalang binary> <shape> <n>...\n");
+    return 1;
+  }
+
+  const char* kalang = argv[1];
+  std::string shape = argv[2];
+  std::string path = "kalang-scale-" + shape + ".k";
+  printf("%-6s %10s %10s %10s %10s\n", shape.c_str(), "seconds", "max rss kb", "time exp", "rss exp");
+
+  double lastSeconds = 0;
+  long lastRss = 0, lastN = 0;
+  bool failed = false;
+  for(int i = 3; i < argc; ++i)
+  {
+    long n = atol(argv[i]);
+    FILE* out = fopen(path.c_str(), "w");
+    if(!out || !generate(shape, n, out))
+    {
+      printf("Error: could not generate %s %ld\n", shape.c_str(), n);
+      return 1;
+    }
+    fclose(out);
+
+    double seconds;
+    long rss;
+    bool ok = measure(kalang, path, seconds, rss);
+    // growth exponent against the previous size: 1 is linear, 2 quadratic
+    std::string timeExp = "-", rssExp = "-";
+    if(lastN && ok)
+    {
+      double scale = std::log((double)n / lastN);
+      timeExp = std::to_string(std::log(seconds / lastSeconds) / scale).substr(0, 5);
+      rssExp = std::to_string(std::log((double)rss / lastRss) / scale).substr(0, 5);
+    }
+    printf("%-6ld %10.3f %10ld %10s %10s%s\n", n, seconds, rss, timeExp.c_str(), rssExp.c_str(),
+      ok ? "" : "  (failed)");
+    fflush(stdout);
+    failed |= !ok;
+    lastN = n;
+    lastSeconds = seconds;
+    lastRss = rss;
+  }
+  unlink(path.c_str());
+  return failed ? 1 : 0;
+}
@@ -25,6 +25,8 @@
 #include <vector>
 #include <utility>
 
+#include "consteval.hpp"
+#include "symtab.hpp"
 #include "token.hpp"
 
 class ExprAST
@@ -32,6 +34,13 @@ class ExprAST
 public:
   virtual ~ExprAST() = default;
   virtual llvm::Value* codegen() = 0;
+  // append the names of the functions this expression calls
+  virtual void collectCallees(std::vector<std::string>&) const {}
+  // compute the value at compile time, false when it is not constant there
+  virtual bool evaluate(ConstEval&, int&) const { return false; }
+  // evaluate where an i1 is generated as well as an i32 (conditions and
+  // values that are thrown away), giving a comparison 0 or 1
+  virtual bool evaluateCondition(ConstEval& eval, int& value) const { return evaluate(eval, value); }
 };
 
 class NumberExprAST : public ExprAST
@@ -41,28 +50,44 @@ private:
 public:
   NumberExprAST(int numVal): m_numVal(numVal) {}
   llvm::Value* codegen() override;
+  bool evaluate(ConstEval& eval, int& value) const override;
 };
 
 class VariableExprAST : public ExprAST
 {
 private:
   std::string m_name;
+  Symbol m_sym;
 public:
-  VariableExprAST(std::string& name): m_name(name) {}
+  VariableExprAST(std::string& name): m_name(name), m_sym(internName(name)) {}
   const std::string& getName() const { return m_name; }
+  Symbol getSymbol() const { return m_sym; }
 
   llvm::Value* codegen() override;
+  bool evaluate(ConstEval& eval, int& value) const override;
 };
 
+// Generated expressions can chain hundreds of thousands of operators, so the
+// operands that are themselves binary expressions are walked with an explicit
+// stack in codegen, evaluate, collectCallees and the destructor, never
+// recursively.
 class BinaryExprAST: public ExprAST
 {
 private:
   Token m_op;
   std::unique_ptr<ExprAST> m_lhs, m_rhs;
+
+  // the instructions of this operator, given its generated operands (lhs is
+  // not generated for '=')
+  llvm::Value* emit(llvm::Value* lhs, llvm::Value* rhs) const;
 public:
   BinaryExprAST(std::unique_ptr<ExprAST> lhs, Token op, std::unique_ptr<ExprAST> rhs)
     : m_lhs(std::move(lhs)), m_op(op), m_rhs(std::move(rhs)) {}
+  ~BinaryExprAST() override;
   llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
+  bool evaluate(ConstEval& eval, int& value) const override;
+  bool evaluateCondition(ConstEval& eval, int& value) const override;
 };
 
 // function call ex: f(x, y)
@@ -75,6 +100,8 @@ public:
   CallExprAST(std::string& callee, std::vector<std::unique_ptr<ExprAST>> args)
     : m_callee(callee), m_args(std::move(args)) {}
   llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
+  bool evaluate(ConstEval& eval, int& value) const override;
 };
 
 class IfExprAST: public ExprAST
@@ -86,12 +113,15 @@ public:
     : m_cond(std::move(cond)), m_then(std::move(then)), m_else(std::move(else_)) {}
 
   llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
+  bool evaluate(ConstEval& eval, int& value) const override;
 };
 
 class ForExprAST: public ExprAST
 {
 private:
   std::string m_varName;
+  Symbol m_varSym;
   std::unique_ptr<ExprAST> m_start, m_end, m_step, m_body;
 
 public:
@@ -103,12 +133,49 @@ public:
     std::unique_ptr<ExprAST> body
   ):
     m_varName(varName),
+    m_varSym(internName(varName)),
     m_start(std::move(start)),
     m_end(std::move(end)),
     m_step(std::move(step)),
     m_body(std::move(body)) {}
 
   llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
+  bool evaluate(ConstEval& eval, int& value) const override;
+};
+
+// parfor: the iterations run on the kalang_parfor thread pool, the body is
+// outlined into a function that runs a chunk of them
+class ParForExprAST: public ExprAST
+{
+private:
+  std::string m_varName;
+  Symbol m_varSym;
+  std::unique_ptr<ExprAST> m_start, m_limit, m_step, m_body;
+  // tok_plus or tok_mult to combine the body values, tok_start for none
+  Token m_reduction;
+
+  llvm::Function* outlineBody(const std::vector<std::pair<Symbol, llvm::Value*>>& captures);
+
+public:
+  ParForExprAST(
+    const std::string& varName,
+    std::unique_ptr<ExprAST> start,
+    std::unique_ptr<ExprAST> limit,
+    std::unique_ptr<ExprAST> step,
+    std::unique_ptr<ExprAST> body,
+    Token reduction
+  ):
+    m_varName(varName),
+    m_varSym(internName(varName)),
+    m_start(std::move(start)),
+    m_limit(std::move(limit)),
+    m_step(std::move(step)),
+    m_body(std::move(body)),
+    m_reduction(reduction) {}
+
+  llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
 };
 
 // function prorotype
@@ -117,10 +184,19 @@ class PrototypeAST
 private:
   std::string m_name;
   std::vector<std::string> m_args;
+  std::vector<Symbol> m_argSyms;
 public:
   PrototypeAST(const std::string& name, std::vector<std::string> args)
-    : m_name(name), m_args(std::move(args)) {}
+    : m_name(name), m_args(std::move(args))
+  {
+    for(auto& arg : m_args)
+    {
+      m_argSyms.push_back(internName(arg));
+    }
+  }
   const std::string& getName() const { return m_name; }
+  Symbol getArgSymbol(unsigned i) const { return m_argSyms[i]; }
+  size_t getNumArgs() const { return m_args.size(); }
   llvm::Function* codegen();
 };
 
@@ -128,11 +204,15 @@ class FuncAST
 {
 private:
   std::unique_ptr<PrototypeAST> m_proto;
-  std::unique_ptr<ExprAST> m_body;
+  // shared with ConstFunctions, to evaluate calls to this function
+  std::shared_ptr<ExprAST> m_body;
 public:
   FuncAST() {}
   FuncAST(std::unique_ptr<PrototypeAST> proto, std::unique_ptr<ExprAST> body)
     : m_proto(std::move(proto)), m_body(std::move(body)) {}
+  const PrototypeAST& getProto() const { return *m_proto; }
+  // the static call graph edges out of this function, without duplicates
+  std::vector<std::string> getCallees() const;
   llvm::Function* codegen();
 };
 
@@ -142,12 +222,21 @@ private:
 
   using varTypes = std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>;
   varTypes m_varNames;
+  std::vector<Symbol> m_varSyms;
   std::unique_ptr<ExprAST> m_body;
   std::unique_ptr<ExprAST> m_retVal;
 
 public:
   VarExprAST(varTypes varNames, std::unique_ptr<ExprAST> body, std::unique_ptr<ExprAST> retVal): 
-    m_varNames(std::move(varNames)), m_body(std::move(body)), m_retVal(std::move(retVal)) {}
+    m_varNames(std::move(varNames)), m_body(std::move(body)), m_retVal(std::move(retVal))
+  {
+    for(auto& var : m_varNames)
+    {
+      m_varSyms.push_back(internName(var.first));
+    }
+  }
 
   llvm::Value* codegen() override;
+  void collectCallees(std::vector<std::string>& callees) const override;
+  bool evaluate(ConstEval& eval, int& value) const override;
 };
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Run every file in paths, where an argument starting with '@' names a
+// manifest listing one path per line. Files run on `workers` threads, each in
+// a codegen context and JITDylib of its own, and the output of each file is
+// printed in one piece, in the order the files were given. Returns 1 if a
+// file could not be read.
+int runBatch(const std::vector<std::string>& paths, unsigned workers);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The character classes the lexer looks at (isspace, isdigit and isalnum in
+// the C locale, which is the one kalang runs in), computed for a whole source
+// at once, 16 or 32 bytes per instruction, into one bit per byte. The lexer
+// then finds the end of a run of spaces, digits or letters with a count of
+// trailing zeros instead of a call per byte.
+
+enum class ScanLevel
+{
+  Scalar,
+  SSE2,
+  AVX2
+};
+
+// the widest level this CPU supports
+ScanLevel bestScanLevel();
+// classify with level from now on, if the CPU supports it; the best level is
+// used until this is called
+void useScanLevel(ScanLevel level);
+const char* scanLevelName(ScanLevel level);
+
+class CharClasses
+{
+private:
+  // bit i % 64 of word i / 64 is set when byte i is in the class
+  std::vector<uint64_t> m_spaces, m_digits, m_alnums;
+  size_t m_size = 0;
+
+  // the first index from i on whose bit is clear, or m_size
+  size_t skip(const std::vector<uint64_t>& bits, size_t i) const
+  {
+    if(i >= m_size)
+    {
+      return m_size;
+    }
+    size_t word = i / 64;
+    uint64_t outside = ~bits[word] >> (i % 64);
+    if(outside)
+    {
+      i += __builtin_ctzll(outside);
+      return i < m_size ? i : m_size;
+    }
+    for(++word; word < bits.size(); ++word)
+    {
+      if(~bits[word])
+      {
+        i = word * 64 + __builtin_ctzll(~bits[word]);
+        return i < m_size ? i : m_size;
+      }
+    }
+    return m_size;
+  }
+
+public:
+  void classify(const char* text, size_t size);
+
+  size_t skipSpaces(size_t i) const { return skip(m_spaces, i); }
+  size_t skipDigits(size_t i) const { return skip(m_digits, i); }
+  size_t skipAlnums(size_t i) const { return skip(m_alnums, i); }
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// bytes of the sections of JIT'd objects
+struct CodeMemoryUsage
+{
+  size_t code = 0;
+  size_t data = 0;
+  // unwind tables and other sections only read by the runtime
+  size_t metadata = 0;
+};
+
+// Maps the pages sections are allocated from. Pages of freed objects are kept
+// for later objects, up to poolLimit bytes, and the rest go back to the OS.
+class PooledMemoryMapper : public llvm::SectionMemoryManager::MemoryMapper
+{
+private:
+  std::mutex m_mutex;
+  std::vector<llvm::sys::MemoryBlock> m_pool;
+  size_t m_poolLimit;
+  size_t m_mapped = 0;
+  size_t m_pooled = 0;
+
+public:
+  explicit PooledMemoryMapper(size_t poolLimit);
+  ~PooledMemoryMapper() override;
+
+  llvm::sys::MemoryBlock allocateMappedMemory(
+    llvm::SectionMemoryManager::AllocationPurpose purpose, size_t numBytes,
+    const llvm::sys::MemoryBlock* const nearBlock, unsigned flags,
+    std::error_code& ec
+  ) override;
+  std::error_code protectMappedMemory(const llvm::sys::MemoryBlock& block, unsigned flags) override;
+  std::error_code releaseMappedMemory(llvm::sys::MemoryBlock& block) override;
+
+  // bytes mapped from the OS, and how many of them wait in the pool
+  size_t mapped();
+  size_t pooled();
+};
+
+class CountingMemoryManager;
+
+// Usage of every loaded object, with the JITDylib and resource tracker it
+// belongs to. Objects leave when the tracker holding them is removed.
+class CodeMemoryStats
+{
+private:
+  struct Object
+  {
+    llvm::orc::JITDylib* jd = nullptr;
+    llvm::orc::ResourceKey key = 0;
+    CodeMemoryUsage usage;
+  };
+
+  std::mutex m_mutex;
+  std::unordered_map<const CountingMemoryManager*, Object> m_objects;
+
+  // the memory manager of the object being loaded on this thread
+  static thread_local CountingMemoryManager* t_loading;
+
+public:
+  void add(CountingMemoryManager* mm);
+  void remove(CountingMemoryManager* mm);
+  void count(CountingMemoryManager* mm, const CodeMemoryUsage& usage);
+
+  // attribute the object just loaded on this thread to R's tracker
+  void claim(llvm::orc::MaterializationResponsibility& R);
+
+  // print totals per JITDylib and per tracker, names label the trackers
+  // that have one
+  void print(PooledMemoryMapper& mapper,
+    const std::unordered_map<llvm::orc::ResourceKey, std::string>& names);
+};
+
+// SectionMemoryManager allocating from a PooledMemoryMapper and counting its
+// sections in a CodeMemoryStats
+class CountingMemoryManager : public llvm::SectionMemoryManager
+{
+private:
+  CodeMemoryStats& m_stats;
+
+public:
+  CountingMemoryManager(PooledMemoryMapper& mapper, CodeMemoryStats& stats);
+  ~CountingMemoryManager() override;
+
+  uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment,
+    unsigned sectionID, llvm::StringRef sectionName) override;
+  uint8_t* allocateDataSection(uintptr_t size, unsigned alignment,
+    unsigned sectionID, llvm::StringRef sectionName, bool isReadOnly) override;
+};
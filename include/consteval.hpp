@@ -0,0 +1,85 @@
+#pragma once
+
+#include "symtab.hpp"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ExprAST;
+class PrototypeAST;
+
+// Calls to a fungsi whose arguments are all constant are evaluated while
+// compiling, by walking the ASTs of the definitions, and replaced with their
+// result. Whatever the evaluator cannot see through (a deklarasi, parfor, a
+// comparison used as a number) leaves the call to be compiled as usual, and
+// so does running out of fuel or of call depth. Only locals are ever written,
+// so such a call has nothing to do at run time but return its value.
+
+// the parameters and body of a definition
+struct ConstFunction
+{
+  std::vector<Symbol> params;
+  std::shared_ptr<const ExprAST> body;
+};
+
+// every fungsi defined so far, by name
+extern thread_local std::unordered_map<std::string, ConstFunction> ConstFunctions;
+
+// The state of one evaluation: the values of the variables of the calls in
+// progress, innermost last, and what is left of its fuel.
+class ConstEval
+{
+private:
+  std::vector<std::pair<Symbol, int>> m_vars;
+  // where the variables of the innermost call start
+  size_t m_frame = 0;
+  uint64_t m_fuel;
+  unsigned m_depth = 0;
+  // results of the calls made so far, the functions are pure
+  std::map<std::pair<const ConstFunction*, std::vector<int>>, int> m_results;
+
+public:
+  ConstEval();
+
+  // take one unit of fuel, false once there is none left
+  bool step()
+  {
+    if(m_fuel == 0)
+    {
+      return false;
+    }
+    --m_fuel;
+    return true;
+  }
+
+  bool lookup(Symbol sym, int& value) const;
+  // store into the visible variable sym, false when there is none
+  bool assign(Symbol sym, int value);
+  void bind(Symbol sym, int value) { m_vars.emplace_back(sym, value); }
+  bool call(const std::string& callee, const std::vector<int>& args, int& value);
+
+  // unbinds the variables bound while it lives
+  class Scope
+  {
+  private:
+    ConstEval& m_eval;
+    size_t m_size;
+
+  public:
+    explicit Scope(ConstEval& eval): m_eval(eval), m_size(eval.m_vars.size()) {}
+    ~Scope() { m_eval.m_vars.resize(m_size); }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+};
+
+// record a definition before its body is generated, and decide whether the
+// calls in that body are folded
+void beginConstDefinition(const PrototypeAST& proto, std::shared_ptr<const ExprAST> body);
+// the value of callee(args) when it can be computed now
+bool foldCall(const std::string& callee, const std::vector<std::unique_ptr<ExprAST>>& args, int& value);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+// Runtime of the data arrays, called from JIT'd code. Each file given with
+// --data (or listed in KALANG_DATA, separated by ':') is mapped read-only and
+// becomes an array of the little-endian i32 it holds, numbered from 0 in the
+// order the files were mapped. Kalang code reads them with the builtins
+// panjang(array) and ambil(array, index), which load straight from the
+// mapping: the lookups below are pure, so the optimizer hoists them out of
+// loops and only the loads are left in the loop body.
+
+// map path as the next array and return its number, -1 when it cannot be
+// opened or mapped (errno tells why)
+extern "C" int32_t kalang_data_map(const char* path);
+
+// first element of array, null for an array that was never mapped
+extern "C" const int32_t* kalang_data_elements(int32_t array);
+
+// number of elements of array, 0 for an array that was never mapped. Bytes
+// past the last whole element are left out, and so is anything past the
+// first 2^31 - 1 elements, which is as far as an i32 index reaches.
+extern "C" int32_t kalang_data_length(int32_t array);
@@ -1,22 +1,80 @@
 #pragma once
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/ThreadPool.h"
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "codemem.hpp"
+#include "data.hpp"
+#include "parfor.hpp"
+#include "perfmap.hpp"
 
 namespace llvm {
 namespace orc {
 
+// Compiles on any number of threads like ConcurrentIRCompiler, but reuses
+// idle TargetMachines instead of creating a new one for every module, which
+// would otherwise dominate the cost of compiling small definitions.
+class PooledIRCompiler : public IRCompileLayer::IRCompiler {
+private:
+  JITTargetMachineBuilder JTMB;
+  std::mutex PoolMutex;
+  std::vector<std::unique_ptr<TargetMachine>> Idle;
+
+public:
+  PooledIRCompiler(JITTargetMachineBuilder JTMB)
+      : IRCompiler(irManglingOptionsFromTargetOptions(JTMB.getOptions())),
+        JTMB(std::move(JTMB)) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    std::unique_ptr<TargetMachine> TM;
+    {
+      std::lock_guard<std::mutex> Lock(PoolMutex);
+      if (!Idle.empty()) {
+        TM = std::move(Idle.back());
+        Idle.pop_back();
+      }
+    }
+    if (!TM) {
+      auto NewTM = JTMB.createTargetMachine();
+      if (!NewTM)
+        return NewTM.takeError();
+      TM = std::move(*NewTM);
+    }
+
+    auto Obj = SimpleCompiler(*TM)(M);
+
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    Idle.push_back(std::move(TM));
+    return Obj;
+  }
+};
+
 class KalangJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
@@ -24,23 +82,119 @@ private:
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  // Pages of removed objects are reused, up to 1MB of them. Both outlive
+  // the memory managers ObjectLayer owns.
+  PooledMemoryMapper CodeMapper{1 << 20};
+  CodeMemoryStats CodeMemory;
+
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
+  IRTransformLayer TransformLayer;
 
   JITDylib &MainJD;
+  // where this thread's definitions go and its lookups start, MainJD unless
+  // it runs a server request or a batch file
+  static inline thread_local JITDylib *CurrentJD = nullptr;
+
+  JITDylib &currentJD() { return CurrentJD ? *CurrentJD : MainJD; }
+
+  // prefetches not finished yet, per JITDylib they started from, which
+  // must not be removed before they are done
+  std::mutex PrefetchMutex;
+  std::condition_variable PrefetchDone;
+  DenseMap<JITDylib *, unsigned> Prefetching;
+
+  // tasks handed to the compile threads and not finished yet, numbered in the
+  // order they were handed over
+  std::mutex TaskMutex;
+  std::condition_variable TaskDone;
+  uint64_t NextTask = 0;
+  std::set<uint64_t> RunningTasks;
+
+  std::unique_ptr<ThreadPool> CompileThreads;
+  std::unique_ptr<PerfMapListener> PerfMap;
+  // sees every object before it is linked here, on the thread linking it
+  std::function<void(const object::ObjectFile &)> ObjectLoaded;
+
+  // Redefinable functions are called through a stub, which points at the
+  // body compiled under the tracker of the current definition.
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  StringMap<ResourceTrackerSP> Definitions;
+  unsigned NextImpl = 0;
+
+  // Lazy functions are exported through a call-through stub that compiles
+  // the body on the first call.
+  std::unique_ptr<LazyCallThroughManager> LazyCallThrough;
+  std::unique_ptr<IndirectStubsManager> LazyStubs;
+  // body symbol of each lazy function, and the bodies of its callees
+  std::mutex LazyMutex;
+  DenseMap<SymbolStringPtr, SymbolStringPtr> LazyImpls;
+  DenseMap<SymbolStringPtr, std::vector<SymbolStringPtr>> LazyCallees;
+  bool Speculate = false;
+
+  static void handleLazyCallThroughError() {
+    report_fatal_error("kalang: failed to compile a lazy function");
+  }
+
+  // Runs when a module is about to be compiled: with speculation on, start
+  // compiling the callees of the functions it defines right away.
+  Expected<ThreadSafeModule> speculate(ThreadSafeModule TSM,
+                                       MaterializationResponsibility &R) {
+    if (!Speculate)
+      return TSM;
+    std::vector<SymbolStringPtr> Callees;
+    {
+      std::lock_guard<std::mutex> Lock(LazyMutex);
+      for (auto &KV : R.getSymbols()) {
+        auto I = LazyCallees.find(KV.first);
+        if (I != LazyCallees.end())
+          Callees.insert(Callees.end(), I->second.begin(), I->second.end());
+      }
+    }
+    for (auto &Callee : Callees)
+      prefetch(Callee);
+    return TSM;
+  }
 
 public:
   KalangJIT(std::unique_ptr<ExecutionSession> ES,
                   JITTargetMachineBuilder JTMB, DataLayout DL)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    [this]() {
+                      return std::make_unique<CountingMemoryManager>(
+                          CodeMapper, CodeMemory);
+                    }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+                     std::make_unique<PooledIRCompiler>(std::move(JTMB))),
+        TransformLayer(*this->ES, CompileLayer,
+                       [this](ThreadSafeModule TSM,
+                              MaterializationResponsibility &R) {
+                         return speculate(std::move(TSM), R);
+                       }),
         MainJD(this->ES->createBareJITDylib("<main>")) {
+    ObjectLayer.setNotifyLoaded(
+        [this](MaterializationResponsibility &R, const object::ObjectFile &Obj,
+               const RuntimeDyld::LoadedObjectInfo &) {
+          CodeMemory.claim(R);
+          if (ObjectLoaded)
+            ObjectLoaded(Obj);
+        });
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
+    // the kalang runtime, called from JIT'd code
+    auto Runtime = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    cantFail(MainJD.define(absoluteSymbols(
+        {{Mangle("kalang_parfor"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&kalang_parfor),
+                             Runtime)},
+         {Mangle("kalang_data_elements"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&kalang_data_elements),
+                             Runtime)},
+         {Mangle("kalang_data_length"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&kalang_data_length),
+                             Runtime)}})));
     if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -48,11 +202,14 @@ public:
   }
 
   ~KalangJIT() {
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KalangJIT>> Create() {
+  static Expected<std::unique_ptr<KalangJIT>>
+  Create(unsigned NumCompileThreads = 0) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
@@ -66,22 +223,279 @@ public:
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KalangJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto J = std::make_unique<KalangJIT>(std::move(ES), std::move(JTMB),
+                                         std::move(*DL));
+    if (NumCompileThreads)
+      J->setNumCompileThreads(NumCompileThreads);
+    return J;
+  }
+
+  // Materialize modules on a pool of background threads instead of on the
+  // thread that issued the lookup.
+  void setNumCompileThreads(unsigned N) {
+    CompileThreads =
+        std::make_unique<ThreadPool>(hardware_concurrency(N));
+    ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+      uint64_t Id;
+      {
+        std::lock_guard<std::mutex> Lock(TaskMutex);
+        Id = NextTask++;
+        RunningTasks.insert(Id);
+      }
+      // ThreadPool::async needs a copyable callable, so hand over ownership
+      // through a raw pointer.
+      CompileThreads->async([this, Id, UnownedT = T.release()]() mutable {
+        std::unique_ptr<Task> T(UnownedT);
+        T->run();
+        T.reset();
+        std::lock_guard<std::mutex> Lock(TaskMutex);
+        RunningTasks.erase(Id);
+        TaskDone.notify_all();
+      });
+    });
+  }
+
+  // Let Linux perf resolve samples in JIT'd code: write /tmp/perf-<pid>.map
+  // and, when LLVM is built with perf support, a jitdump for `perf inject`.
+  void enablePerfSupport() {
+    PerfMap = std::make_unique<PerfMapListener>();
+    ObjectLayer.registerJITEventListener(*PerfMap);
+    if (auto *L = JITEventListener::createPerfJITEventListener())
+      ObjectLayer.registerJITEventListener(*L);
+  }
+
+  bool isConcurrent() const { return CompileThreads != nullptr; }
+
+  // Hand every object compiled from now on to F as well, e.g. to link it
+  // into other processes.
+  void setNotifyObjectLoaded(
+      std::function<void(const object::ObjectFile &)> F) {
+    ObjectLoaded = std::move(F);
+  }
+
+  // Wait for the compile tasks handed over so far. A task still attaches the
+  // memory of an object to its tracker after the object is reported ready;
+  // removing the tracker in between reports it defunct and leaves the
+  // object's EH frames registered.
+  void waitForCompileTasks() {
+    if (!CompileThreads)
+      return;
+    std::unique_lock<std::mutex> Lock(TaskMutex);
+    uint64_t Last = NextTask;
+    TaskDone.wait(Lock, [&] {
+      return RunningTasks.empty() || *RunningTasks.begin() >= Last;
+    });
+  }
+
+  // Free everything RT holds.
+  Error removeModule(ResourceTrackerSP RT) {
+    waitForCompileTasks();
+    return RT->remove();
+  }
+
+  // Let functions be defined again, callers keep calling the same stub.
+  Error enableRedefinition() {
+    auto Builder = createLocalIndirectStubsManagerBuilder(
+        ES->getExecutorProcessControl().getTargetTriple());
+    if (!Builder)
+      return make_error<StringError>("no indirect stubs for this target",
+                                     inconvertibleErrorCode());
+    Stubs = Builder();
+    return Error::success();
+  }
+
+  bool isRedefinable() const { return Stubs != nullptr; }
+
+  bool isDefined(StringRef Name) const { return Definitions.count(Name); }
+
+  // Name a new body of Name gets inside its module, unique for the session.
+  std::string newImplName(StringRef Name) {
+    return (Name + "$" + Twine(NextImpl++)).str();
+  }
+
+  // Compile TSM, which defines ImplName, and make the stub for Name jump to
+  // it. The body of the previous definition of Name is freed.
+  Error defineFunction(StringRef Name, StringRef ImplName,
+                       ThreadSafeModule TSM) {
+    auto RT = currentJD().createResourceTracker();
+    if (auto Err = TransformLayer.add(RT, std::move(TSM)))
+      return Err;
+    auto Impl = lookup(ImplName);
+    if (!Impl) {
+      consumeError(RT->remove());
+      return Impl.takeError();
+    }
+
+    auto Current = Definitions.find(Name);
+    if (Current == Definitions.end()) {
+      if (auto Err = Stubs->createStub(Name, Impl->getAddress(),
+                                       JITSymbolFlags::Exported |
+                                           JITSymbolFlags::Callable))
+        return Err;
+      auto Stub = Stubs->findStub(Name, true);
+      if (auto Err =
+              currentJD().define(absoluteSymbols({{Mangle(Name), Stub}})))
+        return Err;
+      Definitions[Name] = std::move(RT);
+      return Error::success();
+    }
+
+    if (auto Err = Stubs->updatePointer(Name, Impl->getAddress()))
+      return Err;
+    if (auto Err = removeModule(Current->second))
+      return Err;
+    Current->second = std::move(RT);
+    return Error::success();
+  }
+
+  // Print the memory held by loaded objects, per JITDylib and per tracker.
+  // Trackers of function definitions are labeled with the function's name.
+  void printCodeMemory() {
+    std::unordered_map<ResourceKey, std::string> Names;
+    Names[MainJD.getDefaultResourceTracker()->getKeyUnsafe()] = "default";
+    for (auto &D : Definitions)
+      Names[D.second->getKeyUnsafe()] = D.getKey().str();
+    CodeMemory.print(CodeMapper, Names);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  JITDylib &getCurrentJITDylib() { return currentJD(); }
+
+  // Send this thread's definitions and lookups to a new JITDylib that also
+  // sees everything in the main one, until removeRequestJITDylib frees it
+  // with all it holds.
+  JITDylib &beginRequest(StringRef Name) {
+    auto &JD = ES->createBareJITDylib(Name.str());
+    JD.addToLinkOrder(MainJD);
+    CurrentJD = &JD;
+    return JD;
+  }
+
+  Error removeRequestJITDylib(JITDylib &JD) {
+    waitForPrefetches();
+    waitForCompileTasks();
+    {
+      std::lock_guard<std::mutex> Lock(PrefetchMutex);
+      Prefetching.erase(&JD);
+    }
+    CurrentJD = nullptr;
+    return ES->removeJITDylib(JD);
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
-      RT = MainJD.getDefaultResourceTracker();
-    return CompileLayer.add(RT, std::move(TSM));
+      RT = currentJD().getDefaultResourceTracker();
+    return TransformLayer.add(RT, std::move(TSM));
+  }
+
+  // Compile lazy functions on their first call. With Speculate, compiling a
+  // function also starts compiling its callees on the compile threads.
+  Error enableLazyCompilation(bool Speculate) {
+    auto &EPC = ES->getExecutorProcessControl();
+    auto LCTM = createLocalLazyCallThroughManager(
+        EPC.getTargetTriple(), *ES,
+        pointerToJITTargetAddress(&handleLazyCallThroughError));
+    if (!LCTM)
+      return LCTM.takeError();
+    auto Builder = createLocalIndirectStubsManagerBuilder(EPC.getTargetTriple());
+    if (!Builder)
+      return make_error<StringError>("no indirect stubs for this target",
+                                     inconvertibleErrorCode());
+    LazyCallThrough = std::move(*LCTM);
+    LazyStubs = Builder();
+    this->Speculate = Speculate;
+    return Error::success();
+  }
+
+  bool isLazy() const { return LazyCallThrough != nullptr; }
+
+  // Add TSM, which defines the body of Name as ImplName, and export Name as
+  // a stub that compiles the body when it is first called. Callees are the
+  // functions the body calls, compiled early when speculating.
+  Error addLazyFunction(StringRef Name, StringRef ImplName,
+                        ThreadSafeModule TSM,
+                        const std::vector<std::string> &Callees) {
+    auto Impl = Mangle(ImplName.str());
+    {
+      std::lock_guard<std::mutex> Lock(LazyMutex);
+      auto &Edges = LazyCallees[Impl];
+      for (auto &Callee : Callees) {
+        auto I = LazyImpls.find(Mangle(Callee));
+        if (I != LazyImpls.end())
+          Edges.push_back(I->second);
+      }
+      LazyImpls[Mangle(Name.str())] = Impl;
+    }
+
+    if (auto Err = addModule(std::move(TSM)))
+      return Err;
+    SymbolAliasMap Aliases;
+    Aliases[Mangle(Name.str())] = SymbolAliasMapEntry(
+        Impl, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    return currentJD().define(lazyReexports(*LazyCallThrough, *LazyStubs,
+                                           currentJD(), std::move(Aliases)));
+  }
+
+  // the link order of the current JITDylib, which starts with itself
+  JITDylibSearchOrder searchOrder() {
+    return currentJD().withLinkOrderDo(
+        [](const JITDylibSearchOrder &LinkOrder) { return LinkOrder; });
   }
 
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
-    return ES->lookup({&MainJD}, Mangle(Name.str()));
+    return ES->lookup(searchOrder(), Mangle(Name.str()));
+  }
+
+  // Start materializing Name without waiting for it. The returned future is
+  // fulfilled once the symbol is ready to be called.
+  std::future<Expected<JITEvaluatedSymbol>> lookupAsync(StringRef Name) {
+    auto Promise =
+        std::make_shared<std::promise<Expected<JITEvaluatedSymbol>>>();
+    auto Result = Promise->get_future();
+    auto Sym = Mangle(Name.str());
+    ES->lookup(
+        LookupKind::Static, searchOrder(),
+        SymbolLookupSet(Sym), SymbolState::Ready,
+        [Promise, Sym](Expected<SymbolMap> Syms) {
+          if (!Syms)
+            Promise->set_value(Syms.takeError());
+          else
+            Promise->set_value((*Syms)[Sym]);
+        },
+        NoDependenciesToRegister);
+    return Result;
+  }
+
+  // Kick off compilation of Name in the background, any failure is reported
+  // through the session's error reporter.
+  void prefetch(StringRef Name) { prefetch(Mangle(Name.str())); }
+
+  void waitForPrefetches() {
+    auto *JD = &currentJD();
+    std::unique_lock<std::mutex> Lock(PrefetchMutex);
+    PrefetchDone.wait(Lock, [&] { return !Prefetching.lookup(JD); });
+  }
+
+  void prefetch(SymbolStringPtr Sym) {
+    auto *JD = &currentJD();
+    {
+      std::lock_guard<std::mutex> Lock(PrefetchMutex);
+      ++Prefetching[JD];
+    }
+    ES->lookup(
+        LookupKind::Static, searchOrder(),
+        SymbolLookupSet(Sym), SymbolState::Ready,
+        [this, JD](Expected<SymbolMap> Syms) {
+          if (!Syms)
+            ES->reportError(Syms.takeError());
+          std::lock_guard<std::mutex> Lock(PrefetchMutex);
+          --Prefetching[JD];
+          PrefetchDone.notify_all();
+        },
+        NoDependenciesToRegister);
   }
 };
 
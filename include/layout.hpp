@@ -0,0 +1,10 @@
+#pragma once
+
+#include "llvm/IR/Module.h"
+
+// Lay out the program written to dump.ll by the profile that was loaded. The
+// module gets a profile summary, so that the compiler of dump.ll knows what is
+// hot. Regions of functions that never ran are split out into cold functions.
+// Functions that call each other often are placed together, hottest first,
+// and go to .text.hot, those that never ran to .text.unlikely.
+void layoutProgram(llvm::Module& M);
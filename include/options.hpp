@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// command line configuration shared by the driver, parser and codegen
+struct KalangOptions
+{
+  // number of background threads compiling while the main thread executes,
+  // 0 keeps compilation on the main thread
+  unsigned compileThreads = 0;
+  // write function entry and branch counts to this file on exit
+  std::string profileGenerate;
+  // read counts written by an earlier --profile-generate run
+  std::string profileUse;
+  // make JIT'd functions visible to Linux perf
+  bool perf = false;
+  // compile a definition on its first call instead of right away
+  bool lazy = false;
+  // lazy, and compile the callees of a function in the background as soon as
+  // the function itself is compiled
+  bool speculate = false;
+  // compile a file as one module, internalized and optimized across functions
+  bool wholeProgram = false;
+  // inline small functions from earlier definitions into later ones
+  bool inlineImports = false;
+  // generate variables as SSA values instead of allocas for mem2reg
+  bool ssa = false;
+  // write dump.ll without compiling or running anything
+  bool emitOnly = false;
+  // run every path given, each on its own, on a pool of worker threads
+  bool batch = false;
+  // threads of the batch, 0 runs one per core
+  unsigned workers = 0;
+  // serve evaluation requests on this Unix socket instead of running a file
+  std::string serve;
+  // let functions be defined again, the driver sets it for the REPL
+  bool redefine = false;
+  // steps a call with constant arguments may take to be evaluated while
+  // compiling, 0 compiles every call
+  unsigned constEvalFuel = 10000;
+  // calls nested in such an evaluation
+  unsigned constEvalDepth = 256;
+  // apply this fungsi to every record of stdin, after running the file
+  std::string map;
+  // records and results of --map are binary i32 instead of text
+  bool mapBinary = false;
+  // run top level expressions in this many kalang-executor processes, 0
+  // runs them in kalang
+  unsigned executors = 0;
+  // binary files mapped as the arrays ambil and panjang read, in order
+  std::vector<std::string> dataFiles;
+};
+
+extern KalangOptions TheOptions;
+
+// fill TheOptions from the command line, non-flag arguments are returned in
+// positional. Returns false on an unknown or malformed flag.
+bool parseOptions(int argc, char** argv, std::vector<std::string>& positional);
+void printUsage();
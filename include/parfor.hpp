@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+// Runtime of the parfor loop, called from JIT'd code.
+
+// runs the iterations first, first + step, ... below limit and returns their
+// body values combined by the loop's reduction
+typedef int32_t (*KalangParforChunk)(void* env, int32_t first, int32_t limit, int32_t step);
+
+enum KalangReduction
+{
+  KALANG_REDUCE_NONE = 0,
+  KALANG_REDUCE_ADD = 1,
+  KALANG_REDUCE_MUL = 2
+};
+
+// Runs the iterations start, start + step, ... below limit on the work
+// stealing pool, the calling thread included, and returns the reduction of
+// all of them (0 without one). The pool has one thread per core, or
+// KALANG_THREADS threads counting the caller.
+extern "C" int32_t kalang_parfor(int32_t start, int32_t limit, int32_t step,
+  KalangParforChunk chunk, void* env, int32_t reduction);
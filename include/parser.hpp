@@ -1,12 +1,25 @@
 #pragma once
 #include "ast.hpp"
+#include "charscan.hpp"
 #include "token.hpp"
 
 #include <string>
+#include <deque>
 #include <fstream>
+#include <future>
 #include <unordered_map>
 
 #include "jit.hpp"
+#include "remote.hpp"
+
+// top level expression handed to the JIT whose result is not printed yet
+struct PendingExpr
+{
+  std::string name;
+  // frees the expression once it ran, null if it shares a module
+  llvm::orc::ResourceTrackerSP tracker;
+  std::future<llvm::Expected<llvm::JITEvaluatedSymbol>> symbol;
+};
 
 class Parser
 {
@@ -20,8 +33,26 @@ private:
   int m_nextToken;
   std::unordered_map<int, int> m_binopPrecedence;
   std::string m_source;
+  // character classes of m_source, set whenever it is
+  CharClasses m_classes;
   int m_curr_idx;
   Token m_curr_token;
+  int m_anonCount;
+  std::deque<PendingExpr> m_pending;
+  // expressions handed to executor processes, in source order
+  std::deque<std::shared_future<RemoteResult>> m_remote;
+  bool m_wholeProgram;
+  // top level expressions kept in the whole program module, in source order
+  std::vector<std::string> m_programExprs;
+  bool m_inlineImports;
+  bool m_emitOnly;
+
+  void runPendingExprs(bool wait);
+  void printRemoteResults(bool wait);
+  void finishWholeProgram();
+  llvm::Function* codegenDefinition(FuncAST& fAst);
+  void defineRedefinable(FuncAST& fAst);
+  void defineLazy(FuncAST& fAst);
 
 public:
   Parser();
@@ -30,14 +61,12 @@ public:
 
   int getTokPrec();
 
-  std::unique_ptr<ExprAST> parseParenExpr();
   std::unique_ptr<ExprAST> parseIdentifierExpr();
   std::unique_ptr<ExprAST> parseNumberExpr();
   std::unique_ptr<ExprAST> parseIfExpr();
   std::unique_ptr<ExprAST> parseForExpr();
   std::unique_ptr<ExprAST> parseVarExpr();
   std::unique_ptr<ExprAST> parsePrimary();
-  std::unique_ptr<ExprAST> parseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> lhs);
   std::unique_ptr<ExprAST> parseExpression();
   std::unique_ptr<FuncAST> parseDefinition();
   std::unique_ptr<PrototypeAST> parseDeclaration();
@@ -45,12 +74,22 @@ public:
   std::unique_ptr<FuncAST> parseTopLevel();
   
   void read_line(); // repl
+  // the REPL's :time (or :bench when bench), on the expression read
+  void measure(bool bench);
   std::string get_source();
   void skip_whitespace();
   int scan_int();
   void parse();
 
   void read_file(const char* fileName);
+  void read_source(std::string source);
+  // keep every definition and expression in one module that is optimized
+  // across functions before anything runs
+  void setWholeProgram(bool wholeProgram) { m_wholeProgram = wholeProgram; }
+  // let each new module inline small functions defined in earlier modules
+  void setInlineImports(bool inlineImports) { m_inlineImports = inlineImports; }
+  // generate the definitions for dump.ll only, nothing is compiled or run
+  void setEmitOnly(bool emitOnly) { m_emitOnly = emitOnly; }
 
   Token getCurrToken();
   Token advanceToken();
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+
+#include <cstdio>
+#include <mutex>
+
+// Writes /tmp/perf-<pid>.map so that `perf report` can name samples that fall
+// into JIT'd kalang functions. Objects may be loaded from several compile
+// threads, so writes are serialized.
+class PerfMapListener : public llvm::JITEventListener
+{
+private:
+  std::mutex m_mutex;
+  FILE* m_file;
+
+public:
+  PerfMapListener();
+  ~PerfMapListener() override;
+
+  void notifyObjectLoaded(
+    ObjectKey K, const llvm::object::ObjectFile& Obj,
+    const llvm::RuntimeDyld::LoadedObjectInfo& L
+  ) override;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Execution counts of kalang functions. An instrumented run (--profile-generate)
+// counts function entries, the outcome of every if/for branch and the calls
+// between functions, a later run (--profile-use) turns the saved counts into
+// entry counts and branch weights, and lays out dump.ll by them.
+// Branch sites are numbered in codegen order within their function, so the
+// source must not change between the two runs.
+class Profile
+{
+public:
+  struct FunctionCounts
+  {
+    uint64_t entry = 0;
+    std::vector<std::pair<uint64_t, uint64_t>> branches;
+    // calls made to each callee
+    std::unordered_map<std::string, uint64_t> calls;
+  };
+
+private:
+  struct FunctionCounters
+  {
+    uint64_t* entry = nullptr;
+    // first and second counter of each branch site
+    std::vector<uint64_t*> branches;
+    std::unordered_map<std::string, uint64_t*> calls;
+  };
+
+  // counters are referenced by address from JIT'd code, deque keeps them put
+  std::deque<uint64_t> m_storage;
+  std::unordered_map<std::string, FunctionCounters> m_counters;
+  std::unordered_map<std::string, FunctionCounts> m_counts;
+
+  // the function being generated on this thread, and its next branch site
+  static thread_local std::string t_function;
+  static thread_local unsigned t_nextSite;
+  bool m_instrument = false;
+  bool m_annotate = false;
+
+  uint64_t* allocCounters(unsigned n);
+  void emitIncrement(uint64_t* counter);
+  const FunctionCounts* currentCounts() const;
+
+public:
+  void setGenerate(bool enabled) { m_instrument = enabled; }
+  bool isGenerating() const { return m_instrument; }
+  // whether counts were loaded
+  bool isUsing() const { return m_annotate; }
+  const std::unordered_map<std::string, FunctionCounts>& counts() const { return m_counts; }
+
+  // start numbering branch sites of F, must precede the other codegen hooks
+  void beginFunction(llvm::Function* F);
+  // reserve count consecutive sites, returns the first
+  unsigned nextSite(unsigned count = 1)
+  {
+    unsigned site = t_nextSite;
+    t_nextSite += count;
+    return site;
+  }
+
+  // emit a counter increment at the builder's insert point
+  void instrumentEntry();
+  void instrumentBranch(unsigned site, unsigned counter);
+  void instrumentCall(const std::string& callee);
+
+  // attach loaded counts to the IR
+  void annotateEntry(llvm::Function* F);
+  // counter 0 and 1 count the blocks reached through successor 0 and 1
+  void annotateBranch(llvm::BranchInst* br, unsigned site);
+  // a loop takes two sites: counter 0 of site counts entries into the loop,
+  // counter 1 runs past it, and counter 0 of site + 1 counts iterations.
+  // Successor 0 of the guard enters the loop, of the latch is the back edge.
+  void annotateLoop(llvm::BranchInst* guard, llvm::BranchInst* latch, unsigned site);
+
+  bool save(const std::string& path) const;
+  bool load(const std::string& path);
+};
+
+extern Profile TheProfile;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Top level expressions of a file run with --executors N run in N
+// kalang-executor processes instead of in kalang. The JIT still compiles
+// and links every module here, which is how unknown functions and other
+// errors are found, and every object it loads is kept. An executor links
+// the objects kept so far into its own session, through ORC's remote
+// executor protocol over a pair of pipes, before it runs an expression. An
+// object is compiled once for all the executors. Expressions are handed to
+// the executors in turn, each runs its own in order, and one that crashes
+// is replaced by a new process that links everything again.
+
+// what running an expression on an executor gave
+struct RemoteResult
+{
+  bool ok = false;
+  int32_t value = 0;
+  std::string error;
+};
+
+class ExecutorPool
+{
+private:
+  struct Executor
+  {
+    pid_t pid = -1;
+    std::unique_ptr<llvm::orc::ExecutionSession> ES;
+    std::unique_ptr<llvm::orc::RTDyldObjectLinkingLayer> ObjectLayer;
+    llvm::orc::JITDylib* JD = nullptr;
+    // objects of the pool linked into the executor so far
+    size_t linked = 0;
+    // runs the expressions given to this executor one after the other
+    std::unique_ptr<llvm::ThreadPool> queue;
+  };
+
+  std::string m_path;
+  std::vector<std::unique_ptr<Executor>> m_executors;
+  size_t m_next = 0;
+  std::mutex m_objectsMutex;
+  std::vector<std::string> m_objects;
+
+  bool launch(Executor& executor, std::string& error);
+  // end the session and wait for the process, returning its wait status
+  int stop(Executor& executor);
+  RemoteResult run(Executor& executor, const std::string& name);
+
+public:
+  ~ExecutorPool();
+
+  // start n executors, false with a message when one cannot be started
+  bool start(unsigned n);
+  // keep a copy of obj for the executors, called from any thread
+  void addObject(const llvm::object::ObjectFile& obj);
+  // run the int() function name on the next executor, concurrently with
+  // what the others run
+  std::shared_future<RemoteResult> run(const std::string& name);
+};
+
+extern std::unique_ptr<ExecutorPool> TheExecutors;
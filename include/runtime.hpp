@@ -2,6 +2,7 @@
 
 #include "jit.hpp"
 #include "ast.hpp"
+#include "symtab.hpp"
 
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
@@ -14,22 +15,42 @@
 #include <llvm/IR/Function.h>
 #include <llvm/Transforms/Utils/Mem2Reg.h>
 
-extern std::unique_ptr<llvm::LLVMContext> TheContext;
-extern std::unique_ptr<llvm::Module> TheModule;
-extern std::unique_ptr<llvm::IRBuilder<>> Builder;
-extern std::map<std::string, llvm::AllocaInst *> NamedValues;
+#include <cstdio>
+#include <map>
+#include <unordered_map>
+
+// Codegen state belongs to the thread generating code, so that a batch can
+// compile several files at once. Only the JIT is shared.
+extern thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+extern thread_local std::unique_ptr<llvm::Module> TheModule;
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+extern thread_local ScopedSymbolTable NamedValues;
 extern std::shared_ptr<llvm::orc::KalangJIT> TheJIT;
-extern std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-extern std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-extern std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-extern std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-extern std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-extern std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-extern std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+extern thread_local std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+extern thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+extern thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+extern thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+extern thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+extern thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+extern thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+extern thread_local std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 extern llvm::ExitOnError ExitOnErr;
+extern thread_local std::unique_ptr<llvm::LLVMContext> TheProgramContext;
+extern thread_local std::unique_ptr<llvm::Module> TheProgram;
+// where a run prints its results and messages, and its IR (through
+// runErrs). stdout and stderr unless a batch collects each file apart.
+extern thread_local FILE* TheOut;
+extern thread_local FILE* TheErr;
 
+llvm::orc::KalangJIT& getJIT();
+llvm::raw_ostream& runErrs();
 void InitializeModule();
+void InitializeProgram();
+void optimizeFunction(llvm::Function& F);
+void recordDefinition(const llvm::Module& M);
+void optimizeWholeProgram(llvm::Module& M, const std::vector<std::string>& exprs);
+void rememberForInlining(llvm::Function& F);
+void importForInlining(llvm::Module& M);
 llvm::Function* getFunction(std::string Name);
 llvm::AllocaInst* CreateEntryBlockAlloca(llvm::Function* TheFunction, llvm::StringRef varName);
 
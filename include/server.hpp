@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+// kalang-client sends a script over the socket and shuts down its side of the
+// connection. The server answers with a ServeReply, then the script's stdout
+// and stderr, and closes the connection.
+struct ServeReply
+{
+  uint32_t outSize;
+  uint32_t errSize;
+};
+
+// Run the definitions in preludePath (may be null) once, then run every
+// script sent to socketPath in a JITDylib of its own that sees the prelude.
+// Only returns if the socket cannot be set up.
+int serve(const char* socketPath, const char* preludePath);
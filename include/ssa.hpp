@@ -0,0 +1,45 @@
+#pragma once
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/ValueHandle.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// SSA construction during codegen, after Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form". The value of a variable is
+// recorded per basic block as it is written. A read in a block that does not
+// write it looks through the predecessors, and places a phi where they merge.
+// Until all predecessors of a block are generated (a loop header before its
+// latch), the block is unsealed and a read there gets a phi without operands,
+// filled in when the block is sealed. A phi that turns out to merge a single
+// value is replaced by it right away.
+class SSABuilder
+{
+private:
+  std::vector<std::string> m_names;
+  // follow a removed phi to the value that replaced it
+  llvm::DenseMap<std::pair<int, llvm::BasicBlock*>, llvm::WeakTrackingVH> m_defs;
+  llvm::DenseSet<llvm::BasicBlock*> m_sealed;
+  llvm::DenseMap<llvm::BasicBlock*, std::vector<std::pair<int, llvm::PHINode*>>> m_incomplete;
+
+  llvm::Value* readRecursive(int var, llvm::BasicBlock* block);
+  llvm::Value* addPhiOperands(int var, llvm::PHINode* phi);
+  llvm::Value* removeTrivialPhi(llvm::PHINode* phi);
+  llvm::PHINode* newPhi(int var, llvm::BasicBlock* block);
+
+public:
+  // forget the variables and blocks of the functions generated before
+  void reset();
+  int newVariable(llvm::StringRef name);
+  void write(int var, llvm::BasicBlock* block, llvm::Value* value) { m_defs[{var, block}] = value; }
+  llvm::Value* read(int var, llvm::BasicBlock* block);
+  // no more predecessors are going to be added to block
+  void seal(llvm::BasicBlock* block);
+};
+
+extern thread_local SSABuilder TheSSA;
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+
+// --map: apply a fungsi to every record of stdin and write its results to
+// stdout, like a compiled awk. A record holds as many integers as the
+// function takes arguments. As text, they are separated by whitespace
+// (usually one record per line) and each result is written on a line of its
+// own. As binary, a record is that many i32 in the machine's byte order and
+// each result is one i32. Records are parsed a batch at a time, and the batch
+// is handed to a loop generated around the function, so the function is
+// called (or inlined) from JIT'd code instead of once per record from C++.
+// Returns the exit status: 1 when the function is not defined or the input
+// is malformed.
+int runMap(const std::string& function, bool binary);
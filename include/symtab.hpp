@@ -0,0 +1,93 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Value.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// interned identifier, an index into TheSymbolNames
+using Symbol = uint32_t;
+
+// Maps each distinct identifier to a small dense Symbol. Open addressing with
+// linear probing, the table stores symbol + 1 so that 0 marks an empty slot.
+class SymbolInterner
+{
+private:
+  std::vector<std::string> m_names;
+  std::vector<uint64_t> m_hashes;
+  std::vector<Symbol> m_slots;
+
+  void grow();
+
+public:
+  SymbolInterner();
+
+  Symbol intern(llvm::StringRef name);
+  const std::string& name(Symbol sym) const { return m_names[sym]; }
+  size_t size() const { return m_names.size(); }
+};
+
+// Where a variable lives: the address of its i32 (an alloca, or a pointer
+// loaded from a parfor environment), or with --ssa a variable of TheSSA,
+// whose value is tracked per basic block without going through memory.
+struct VarBinding
+{
+  llvm::Value* address = nullptr;
+  int ssaVar = -1;
+
+  VarBinding() = default;
+  VarBinding(llvm::Value* address): address(address) {}
+  static VarBinding ssa(int var)
+  {
+    VarBinding binding;
+    binding.ssaVar = var;
+    return binding;
+  }
+  explicit operator bool() const { return address || ssaVar >= 0; }
+};
+
+// Variable bindings of the function being generated. The binding of every
+// symbol lives in a flat array indexed by the symbol, and shadowed bindings go
+// to an undo log that popScope() unwinds, so lookups and scope changes never
+// hash or allocate once the arrays have grown.
+class ScopedSymbolTable
+{
+private:
+  std::vector<VarBinding> m_bindings;
+  std::vector<std::pair<Symbol, VarBinding>> m_undo;
+  std::vector<size_t> m_scopes;
+
+public:
+  VarBinding lookup(Symbol sym) const
+  {
+    return sym < m_bindings.size() ? m_bindings[sym] : VarBinding();
+  }
+
+  void bind(Symbol sym, VarBinding binding);
+  void pushScope() { m_scopes.push_back(m_undo.size()); }
+  void popScope();
+  // every symbol that currently has a binding, with that binding
+  std::vector<std::pair<Symbol, VarBinding>> visible() const;
+};
+
+// pops the scope it pushed when it goes out of scope, also on error returns
+class SymbolScope
+{
+private:
+  ScopedSymbolTable& m_table;
+
+public:
+  explicit SymbolScope(ScopedSymbolTable& table): m_table(table) { m_table.pushScope(); }
+  ~SymbolScope() { m_table.popScope(); }
+  SymbolScope(const SymbolScope&) = delete;
+  SymbolScope& operator=(const SymbolScope&) = delete;
+};
+
+extern thread_local SymbolInterner TheSymbolNames;
+
+inline Symbol internName(llvm::StringRef name)
+{
+  return TheSymbolNames.intern(name);
+}
@@ -25,5 +25,6 @@ enum Token
   tok_in,
   tok_then,
   tok_else,
-  tok_var
+  tok_var,
+  tok_parfor
 };
@@ -1,7 +1,48 @@
 #include "runtime.hpp"
 #include "ast.hpp"
+#include "profile.hpp"
+#include "parfor.hpp"
+#include "options.hpp"
+#include "ssa.hpp"
+#include "data.hpp"
+#include <algorithm>
+#include <atomic>
 #include <iterator>
 
+// A new variable of the function being generated, holding value: an alloca
+// that mem2reg promotes later, or with --ssa a variable of TheSSA.
+static VarBinding defineVariable(llvm::Function* TheFunction, llvm::StringRef name, llvm::Value* value)
+{
+  if(TheOptions.ssa)
+  {
+    auto var = VarBinding::ssa(TheSSA.newVariable(name));
+    TheSSA.write(var.ssaVar, Builder->GetInsertBlock(), value);
+    return var;
+  }
+  auto* Alloca = CreateEntryBlockAlloca(TheFunction, name);
+  Builder->CreateStore(value, Alloca);
+  return Alloca;
+}
+
+static llvm::Value* readVariable(const VarBinding& var, llvm::StringRef name)
+{
+  if(var.address)
+  {
+    return Builder->CreateLoad(llvm::Type::getInt32Ty(*TheContext), var.address, name);
+  }
+  return TheSSA.read(var.ssaVar, Builder->GetInsertBlock());
+}
+
+static void writeVariable(const VarBinding& var, llvm::Value* value)
+{
+  if(var.address)
+  {
+    Builder->CreateStore(value, var.address);
+    return;
+  }
+  TheSSA.write(var.ssaVar, Builder->GetInsertBlock(), value);
+}
+
 llvm::Value* NumberExprAST::codegen()
 {
   return llvm::ConstantInt::get(llvm::Type::getInt32Ty(*TheContext), (m_numVal), true);
@@ -10,43 +51,106 @@ llvm::Value* NumberExprAST::codegen()
 llvm::Value* VariableExprAST::codegen()
 {
   // Look this variable up in the function.
-  llvm::AllocaInst* A = NamedValues[m_name];
-  if (nullptr == A)
+  VarBinding A = NamedValues.lookup(m_sym);
+  if (!A)
   {
-    printf("Unknown variable name\n");
+    fprintf(TheOut, "Unknown variable name\n");
     return nullptr;
   }
-  return Builder->CreateLoad(A->getAllocatedType(), A, m_name.c_str());
+  return readVariable(A, m_name);
+}
+
+BinaryExprAST::~BinaryExprAST()
+{
+  std::vector<std::unique_ptr<ExprAST>> operands;
+  operands.push_back(std::move(m_lhs));
+  operands.push_back(std::move(m_rhs));
+  while(!operands.empty())
+  {
+    auto operand = std::move(operands.back());
+    operands.pop_back();
+    // take the operands of a binary operand before it is freed, so that its
+    // own destructor has nothing left to walk
+    if(auto* binary = dynamic_cast<BinaryExprAST*>(operand.get()))
+    {
+      operands.push_back(std::move(binary->m_lhs));
+      operands.push_back(std::move(binary->m_rhs));
+    }
+  }
 }
 
 llvm::Value* BinaryExprAST::codegen()
 {
-  if (m_op == tok_assignment)
+  // Post-order walk over the binary operators below this one: an operator is
+  // visited once to queue its operands (lhs generated first) and once more to
+  // combine their values. Any other operand is generated as it is reached.
+  struct Visit
   {
+    ExprAST* expr;
+    bool combine;
+  };
+  std::vector<Visit> visits{{this, false}};
+  std::vector<llvm::Value*> values;
+  while(!visits.empty())
+  {
+    Visit visit = visits.back();
+    visits.pop_back();
+    auto* binary = dynamic_cast<BinaryExprAST*>(visit.expr);
+    if(!binary)
+    {
+      values.push_back(visit.expr->codegen());
+      continue;
+    }
+    bool assignment = binary->m_op == tok_assignment;
+    if(visit.combine)
+    {
+      llvm::Value* rhs = values.back();
+      values.pop_back();
+      llvm::Value* lhs = nullptr;
+      if(!assignment)
+      {
+        lhs = values.back();
+        values.pop_back();
+      }
+      values.push_back(binary->emit(lhs, rhs));
+      continue;
+    }
     // do not emit lhs as expression
-    // left hand side equation
-    auto* lhse = dynamic_cast<VariableExprAST*>(m_lhs.get());
-    if(!lhse)
+    if(assignment && !dynamic_cast<VariableExprAST*>(binary->m_lhs.get()))
     {
-      printf("destination of '=' must be a variable\n");
-      return nullptr;
+      fprintf(TheOut, "destination of '=' must be a variable\n");
+      values.push_back(nullptr);
+      continue;
     }
-    auto* val = m_rhs->codegen();
-    if(!val)
+    visits.push_back({binary, true});
+    visits.push_back({binary->m_rhs.get(), false});
+    if(!assignment)
+    {
+      visits.push_back({binary->m_lhs.get(), false});
+    }
+  }
+  return values.back();
+}
+
+llvm::Value* BinaryExprAST::emit(llvm::Value* lhs, llvm::Value* rhs) const
+{
+  if (m_op == tok_assignment)
+  {
+    // left hand side equation
+    auto* lhse = static_cast<VariableExprAST*>(m_lhs.get());
+    if(!rhs)
     {
       return nullptr;
     }
-    auto* variable = NamedValues[lhse->getName()];
+    VarBinding variable = NamedValues.lookup(lhse->getSymbol());
     if(!variable)
     {
-      printf("Unknown variable name\n");
+      fprintf(TheOut, "Unknown variable name\n");
       return nullptr;
     }
-    Builder->CreateStore(val, variable);
-    return val;
+    writeVariable(variable, rhs);
+    return rhs;
   }
-  llvm::Value* lhs = m_lhs->codegen();
-  llvm::Value* rhs = m_rhs->codegen();
   if (!lhs || !rhs)
     return nullptr;
  
@@ -60,24 +164,108 @@ llvm::Value* BinaryExprAST::codegen()
   case tok_less:
     return Builder->CreateICmpSLT(lhs, rhs, "cmptmp");
   default:
-    printf("Error: Invalid binary operator\n");
+    fprintf(TheOut, "Error: Invalid binary operator\n");
+    return nullptr;
+  }
+}
+
+// ambil and panjang read the --data arrays, unless a fungsi or deklarasi of
+// that name hides them
+static bool isDataBuiltin(const std::string& callee)
+{
+  return (callee == "ambil" || callee == "panjang") && !FunctionProtos.count(callee);
+}
+
+// A lookup of the data runtime. It always returns the same for the same
+// array, so calls of it are merged and hoisted out of loops.
+static llvm::FunctionCallee dataLookup(const char* name, llvm::Type* result)
+{
+  auto* i32 = llvm::Type::getInt32Ty(*TheContext);
+  auto callee = TheModule->getOrInsertFunction(name, llvm::FunctionType::get(result, {i32}, false));
+  if(auto* F = llvm::dyn_cast<llvm::Function>(callee.getCallee()))
+  {
+    F->setDoesNotAccessMemory();
+    F->setDoesNotThrow();
+    F->setWillReturn();
+    F->addFnAttr(llvm::Attribute::Speculatable);
+  }
+  return callee;
+}
+
+// ambil(array, index) loads the element in place, 0 when index is out of
+// range. panjang(array) is the number of elements.
+static llvm::Value* codegenDataBuiltin(const std::string& callee, const std::vector<std::unique_ptr<ExprAST>>& args)
+{
+  if(args.size() != (callee == "ambil" ? 2 : 1))
+  {
+    fprintf(TheOut, "Incorrect # arguments passed\n");
     return nullptr;
   }
+  llvm::Value* array = args[0]->codegen();
+  if(!array)
+  {
+    return nullptr;
+  }
+  auto* i32 = llvm::Type::getInt32Ty(*TheContext);
+  auto* length = Builder->CreateCall(dataLookup("kalang_data_length", i32), {array}, "panjang");
+  if(callee == "panjang")
+  {
+    return length;
+  }
+  llvm::Value* index = args[1]->codegen();
+  if(!index)
+  {
+    return nullptr;
+  }
+  auto* elements = Builder->CreateCall(dataLookup("kalang_data_elements", i32->getPointerTo()), {array}, "data");
+
+  // unsigned, so that a negative index is out of range too
+  llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
+  auto* inRange = Builder->CreateICmpULT(index, length, "inrange");
+  auto* from = Builder->GetInsertBlock();
+  auto* loadBB = llvm::BasicBlock::Create(*TheContext, "ambil", TheFunction);
+  auto* mergeBB = llvm::BasicBlock::Create(*TheContext, "mergeambil", TheFunction);
+  Builder->CreateCondBr(inRange, loadBB, mergeBB);
+  TheSSA.seal(loadBB);
+  Builder->SetInsertPoint(loadBB);
+  auto* element = Builder->CreateLoad(i32,
+    Builder->CreateInBoundsGEP(i32, elements, Builder->CreateZExt(index, Builder->getInt64Ty())), "elem");
+  // the mapping is read-only and never changes while code runs
+  element->setMetadata(llvm::LLVMContext::MD_invariant_load, llvm::MDNode::get(*TheContext, {}));
+  Builder->CreateBr(mergeBB);
+  TheSSA.seal(mergeBB);
+  Builder->SetInsertPoint(mergeBB);
+  auto* value = Builder->CreatePHI(i32, 2, "ambiltmp");
+  value->addIncoming(llvm::ConstantInt::get(i32, 0), from);
+  value->addIncoming(element, loadBB);
+  return value;
 }
 
 llvm::Value* CallExprAST::codegen()
 {
+  int folded;
+  if(foldCall(m_callee, m_args, folded))
+  {
+    return llvm::ConstantInt::get(llvm::Type::getInt32Ty(*TheContext), folded, true);
+  }
+  if(isDataBuiltin(m_callee))
+  {
+    return codegenDataBuiltin(m_callee, m_args);
+  }
+
   // Look up the name in the global module table.
   llvm::Function *CalleeF = getFunction(m_callee);
   if (!CalleeF)
   {
-    printf("Unknown function referenced\n");
+    fprintf(TheOut, "Unknown function referenced\n");
+    return nullptr;
   }
 
   // If argument mismatch error.
   if (CalleeF->arg_size() != m_args.size())
   {
-    printf("Incorrect # arguments passed");
+    fprintf(TheOut, "Incorrect # arguments passed\n");
+    return nullptr;
   }
 
   std::vector<llvm::Value *> ArgsV;
@@ -87,6 +275,7 @@ llvm::Value* CallExprAST::codegen()
       return nullptr;
   }
 
+  TheProfile.instrumentCall(m_callee);
   return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
@@ -119,8 +308,13 @@ llvm::Value* IfExprAST::codegen()
   auto* elseBB = llvm::BasicBlock::Create(*TheContext, "else", TheFunction);
   auto* mergeBB = llvm::BasicBlock::Create(*TheContext, "mergeif", TheFunction);
 
-  Builder->CreateCondBr(condv, thenBB, elseBB);
+  unsigned site = TheProfile.nextSite();
+  auto* br = Builder->CreateCondBr(condv, thenBB, elseBB);
+  TheProfile.annotateBranch(br, site);
+  TheSSA.seal(thenBB);
+  TheSSA.seal(elseBB);
   Builder->SetInsertPoint(thenBB);
+  TheProfile.instrumentBranch(site, 0);
 
   auto* thenV = m_then->codegen();
   if(!thenV)
@@ -128,15 +322,20 @@ llvm::Value* IfExprAST::codegen()
     return nullptr;
   }
   Builder->CreateBr(mergeBB);
+  // a loop inside the branch leaves the builder in another block
+  thenBB = Builder->GetInsertBlock();
 
   Builder->SetInsertPoint(elseBB);
+  TheProfile.instrumentBranch(site, 1);
   auto* elseV = m_else->codegen();
   if(!elseV)
   {
     return nullptr;
   }
   Builder->CreateBr(mergeBB);
+  elseBB = Builder->GetInsertBlock();
 
+  TheSSA.seal(mergeBB);
   Builder->SetInsertPoint(mergeBB);
   auto* phiNode = Builder->CreatePHI(llvm::Type::getInt32Ty(*TheContext), 2, "iftmp");
   phiNode->addIncoming(thenV, thenBB);
@@ -144,34 +343,50 @@ llvm::Value* IfExprAST::codegen()
   return phiNode;
 }
 
+// a loop condition of another type than i1 holds while it is not 0
+static llvm::Value* loopCondition(ExprAST& end)
+{
+  auto* cond = end.codegen();
+  if(!cond || cond->getType()->isIntegerTy(1))
+  {
+    return cond;
+  }
+  return Builder->CreateICmpNE(cond, llvm::ConstantInt::get(cond->getType(), 0), "loopcond");
+}
+
+// Lowered as a rotated loop: a guard tests the end condition before the first
+// iteration, the preheader evaluates the step once, and the latch at the
+// bottom of the body increments the variable and tests again.
 llvm::Value* ForExprAST::codegen()
 {
   llvm::Function* TheFunction = Builder->GetInsertBlock()->getParent();
-  llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, m_varName);
 
   auto startV = m_start->codegen();
   if(!startV)
   {
     return nullptr;
   }
-  Builder->CreateStore(startV, Alloca);
 
-  auto* preLoopBB = Builder->GetInsertBlock();
+  // the loop variable shadows any outer one until the loop ends
+  SymbolScope scope(NamedValues);
+  VarBinding var = defineVariable(TheFunction, m_varName, startV);
+  NamedValues.bind(m_varSym, var);
+
+  auto* preheaderBB = llvm::BasicBlock::Create(*TheContext, "preheader", TheFunction);
   auto* loopBB = llvm::BasicBlock::Create(*TheContext, "loop", TheFunction);
   auto* afterLoopBB = llvm::BasicBlock::Create(*TheContext, "afterloop", TheFunction);
-  
-  Builder->CreateBr(loopBB);
-  Builder->SetInsertPoint(loopBB);
+  unsigned site = TheProfile.nextSite(2);
 
-  auto* oldVal = NamedValues[m_varName];
-  NamedValues[m_varName] = Alloca;
- 
-  auto body = m_body->codegen();
-  if(!body)
+  auto* guardCond = loopCondition(*m_end);
+  if(!guardCond)
   {
     return nullptr;
   }
- 
+  auto* guard = Builder->CreateCondBr(guardCond, preheaderBB, afterLoopBB);
+  TheSSA.seal(preheaderBB);
+
+  Builder->SetInsertPoint(preheaderBB);
+  TheProfile.instrumentBranch(site, 0);
   llvm::Value* stepVal = nullptr;
   if(m_step)
   {
@@ -186,35 +401,32 @@ llvm::Value* ForExprAST::codegen()
     // the default value of stepVal is 1
     stepVal = llvm::ConstantInt::get(llvm::Type::getInt32Ty(*TheContext), 1);
   }
+  Builder->CreateBr(loopBB);
 
-  auto* currVar = Builder->CreateLoad(Alloca->getAllocatedType(), Alloca, m_varName.c_str());
+  Builder->SetInsertPoint(loopBB);
+  TheProfile.instrumentBranch(site + 1, 0);
+  auto body = m_body->codegen();
+  if(!body)
+  {
+    return nullptr;
+  }
+
+  auto* currVar = readVariable(var, m_varName);
   auto* nextVar = Builder->CreateAdd(currVar, stepVal, "nextvar");
-  Builder->CreateStore(nextVar, Alloca);
+  writeVariable(var, nextVar);
 
-  auto* endCond = m_end->codegen();
+  auto* endCond = loopCondition(*m_end);
   if(!endCond)
   {
     return nullptr;
   }
+  auto* latch = Builder->CreateCondBr(endCond, loopBB, afterLoopBB);
+  TheProfile.annotateLoop(guard, latch, site);
+  TheSSA.seal(loopBB);
+  TheSSA.seal(afterLoopBB);
 
-  endCond = Builder->CreateICmpEQ(
-    endCond,
-    llvm::ConstantInt::get(llvm::Type::getInt1Ty(*TheContext), 1), "loopcond"
-  );
-
-  Builder->CreateCondBr(endCond, loopBB, afterLoopBB);
   Builder->SetInsertPoint(afterLoopBB);
-
-  // restore the unshadowed variable (restore the old value of that variable)
-  if(oldVal)
-  {
-    NamedValues[m_varName] = oldVal;
-  }
-  else
-  {
-    // if there is no variable being shadowed
-    NamedValues.erase(m_varName);
-  }
+  TheProfile.instrumentBranch(site, 1);
 
   return llvm::ConstantInt::get(llvm::Type::getInt32Ty(*TheContext), 0);
 }
@@ -250,18 +462,22 @@ llvm::Function* FuncAST::codegen()
   {
     return nullptr;
   }
+  beginConstDefinition(P, m_body);
 
   // Create a new basic block to start insertion into.
   llvm::BasicBlock *BB = llvm::BasicBlock::Create(*TheContext, "entry", TheFunction);
+  TheSSA.reset();
+  TheSSA.seal(BB);
   Builder->SetInsertPoint(BB);
+  TheProfile.beginFunction(TheFunction);
+  TheProfile.annotateEntry(TheFunction);
+  TheProfile.instrumentEntry();
 
-  // Record the function arguments in the NamedValues map.
-  NamedValues.clear();
+  // Record the function arguments in the symbol table.
+  SymbolScope scope(NamedValues);
   for (auto &Arg : TheFunction->args())
   {
-    auto* Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
-    Builder->CreateStore(&Arg, Alloca);
-    NamedValues[std::string(Arg.getName())] = Alloca;
+    NamedValues.bind(P.getArgSymbol(Arg.getArgNo()), defineVariable(TheFunction, Arg.getName(), &Arg));
   }
 
   if (llvm::Value *RetVal = m_body->codegen()) {
@@ -270,18 +486,20 @@ llvm::Function* FuncAST::codegen()
 
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
-    TheFPM->run(*TheFunction, *TheFAM);
+    optimizeFunction(*TheFunction);
     return TheFunction;
   }
 
   // Error reading body, remove function.
+  ConstFunctions.erase(P.getName());
   TheFunction->eraseFromParent();
   return nullptr;
 }
 
 llvm::Value* VarExprAST::codegen()
 {
-  std::vector<llvm::AllocaInst*> oldBindings;
+  // bindings made here are undone when codegen leaves this expression
+  SymbolScope scope(NamedValues);
   auto* TheFunction = Builder->GetInsertBlock()->getParent();
 
   for(unsigned i = 0; i < m_varNames.size(); ++i)
@@ -304,10 +522,7 @@ llvm::Value* VarExprAST::codegen()
       // set 0 as the default value
       initVal = llvm::ConstantInt::get(llvm::Type::getInt32Ty(*TheContext), 0);
     }
-    llvm::AllocaInst* Alloca = CreateEntryBlockAlloca(TheFunction, varName);
-    auto x = Builder->CreateStore(initVal, Alloca);
-    oldBindings.push_back(NamedValues[varName]);
-    NamedValues[varName] = Alloca;
+    NamedValues.bind(m_varSyms[i], defineVariable(TheFunction, varName, initVal));
   }
 
 
@@ -323,11 +538,432 @@ llvm::Value* VarExprAST::codegen()
   {
     return nullptr;
   }
-  for(unsigned i = 0; i < m_varNames.size(); ++i)
+  return retVal;
+}
+
+
+void BinaryExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  std::vector<const ExprAST*> operands{m_rhs.get(), m_lhs.get()};
+  while(!operands.empty())
   {
-    NamedValues[m_varNames[i].first] = oldBindings[i];
+    auto* operand = operands.back();
+    operands.pop_back();
+    if(auto* binary = dynamic_cast<const BinaryExprAST*>(operand))
+    {
+      operands.push_back(binary->m_rhs.get());
+      operands.push_back(binary->m_lhs.get());
+      continue;
+    }
+    operand->collectCallees(callees);
   }
+}
 
-  return retVal;
+void CallExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  if(!isDataBuiltin(m_callee))
+  {
+    callees.push_back(m_callee);
+  }
+  for(auto& arg : m_args)
+  {
+    arg->collectCallees(callees);
+  }
+}
+
+void IfExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  m_cond->collectCallees(callees);
+  m_then->collectCallees(callees);
+  m_else->collectCallees(callees);
+}
+
+void ForExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  m_start->collectCallees(callees);
+  m_end->collectCallees(callees);
+  if(m_step)
+  {
+    m_step->collectCallees(callees);
+  }
+  m_body->collectCallees(callees);
+}
+
+void VarExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  for(auto& var : m_varNames)
+  {
+    if(var.second)
+    {
+      var.second->collectCallees(callees);
+    }
+  }
+  m_body->collectCallees(callees);
+  m_retVal->collectCallees(callees);
+}
+
+std::vector<std::string> FuncAST::getCallees() const
+{
+  std::vector<std::string> callees;
+  m_body->collectCallees(callees);
+  std::sort(callees.begin(), callees.end());
+  callees.erase(std::unique(callees.begin(), callees.end()), callees.end());
+  return callees;
+}
+
+void ParForExprAST::collectCallees(std::vector<std::string>& callees) const
+{
+  m_start->collectCallees(callees);
+  m_limit->collectCallees(callees);
+  if(m_step)
+  {
+    m_step->collectCallees(callees);
+  }
+  m_body->collectCallees(callees);
+}
+
+// bodies are named uniquely for the whole session, since the modules holding
+// them get merged into the program module and imported by later ones
+static std::atomic<unsigned> ParForCount(0);
+
+// Generate `i32 chunk(i8* env, i32 first, i32 limit, i32 step)`, which runs
+// the iterations of one chunk and returns their reduction. env holds a
+// pointer to every captured variable, the body works on them in place.
+llvm::Function* ParForExprAST::outlineBody(const std::vector<std::pair<Symbol, llvm::Value*>>& captures)
+{
+  auto* i32 = llvm::Type::getInt32Ty(*TheContext);
+  auto* i32Ptr = i32->getPointerTo();
+  auto* FT = llvm::FunctionType::get(i32, {Builder->getInt8PtrTy(), i32, i32, i32}, false);
+  auto* F = llvm::Function::Create(FT, llvm::Function::InternalLinkage,
+    "__parfor" + std::to_string(ParForCount++), TheModule.get());
+  auto* envArg = F->getArg(0);
+  auto* firstArg = F->getArg(1);
+  auto* limitArg = F->getArg(2);
+  auto* stepArg = F->getArg(3);
+  envArg->setName("env");
+  firstArg->setName("first");
+  limitArg->setName("limit");
+  stepArg->setName("step");
+
+  auto savedIP = Builder->saveIP();
+  auto* entryBB = llvm::BasicBlock::Create(*TheContext, "entry", F);
+  TheSSA.seal(entryBB);
+  Builder->SetInsertPoint(entryBB);
+
+  SymbolScope scope(NamedValues);
+  auto* env = Builder->CreateBitCast(envArg, i32Ptr->getPointerTo());
+  for(unsigned i = 0; i < captures.size(); ++i)
+  {
+    auto* slot = Builder->CreateConstInBoundsGEP1_32(i32Ptr, env, i);
+    NamedValues.bind(captures[i].first,
+      Builder->CreateLoad(i32Ptr, slot, TheSymbolNames.name(captures[i].first)));
+  }
+
+  VarBinding var = defineVariable(F, m_varName, firstArg);
+  NamedValues.bind(m_varSym, var);
+  VarBinding acc = defineVariable(F, "acc", llvm::ConstantInt::get(i32, m_reduction == tok_mult ? 1 : 0));
+
+  // the runtime never passes an empty chunk
+  auto* loopBB = llvm::BasicBlock::Create(*TheContext, "loop", F);
+  auto* afterLoopBB = llvm::BasicBlock::Create(*TheContext, "afterloop", F);
+  Builder->CreateBr(loopBB);
+  Builder->SetInsertPoint(loopBB);
+
+  auto* body = m_body->codegen();
+  if(!body)
+  {
+    Builder->restoreIP(savedIP);
+    F->eraseFromParent();
+    return nullptr;
+  }
+  if(m_reduction != tok_start)
+  {
+    auto* accV = readVariable(acc, "acc");
+    auto* combined = m_reduction == tok_plus
+      ? Builder->CreateAdd(accV, body, "reduce")
+      : Builder->CreateMul(accV, body, "reduce");
+    writeVariable(acc, combined);
+  }
+
+  auto* currVar = readVariable(var, m_varName);
+  auto* nextVar = Builder->CreateAdd(currVar, stepArg, "nextvar");
+  writeVariable(var, nextVar);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(nextVar, limitArg, "loopcond"), loopBB, afterLoopBB);
+  TheSSA.seal(loopBB);
+  TheSSA.seal(afterLoopBB);
+
+  Builder->SetInsertPoint(afterLoopBB);
+  Builder->CreateRet(readVariable(acc, "acc"));
+
+  verifyFunction(*F);
+  optimizeFunction(*F);
+  Builder->restoreIP(savedIP);
+  return F;
+}
+
+llvm::Value* ParForExprAST::codegen()
+{
+  auto* i32 = llvm::Type::getInt32Ty(*TheContext);
+  auto* startV = m_start->codegen();
+  auto* limitV = m_limit->codegen();
+  if(!startV || !limitV)
+  {
+    return nullptr;
+  }
+  llvm::Value* stepV = llvm::ConstantInt::get(i32, 1);
+  if(m_step)
+  {
+    stepV = m_step->codegen();
+    if(!stepV)
+    {
+      return nullptr;
+    }
+  }
+
+  // the body works on the captured variables in place, so those held in SSA
+  // values are spilled for the call and read back after it
+  auto* TheFunction = Builder->GetInsertBlock()->getParent();
+  auto visible = NamedValues.visible();
+  std::vector<std::pair<Symbol, llvm::Value*>> captures;
+  for(auto& binding : visible)
+  {
+    llvm::Value* address = binding.second.address;
+    if(!address)
+    {
+      const std::string& name = TheSymbolNames.name(binding.first);
+      address = CreateEntryBlockAlloca(TheFunction, name);
+      Builder->CreateStore(readVariable(binding.second, name), address);
+    }
+    captures.emplace_back(binding.first, address);
+  }
+  auto* chunk = outlineBody(captures);
+  if(!chunk)
+  {
+    return nullptr;
+  }
+
+  auto* i32Ptr = i32->getPointerTo();
+  auto* envTy = llvm::ArrayType::get(i32Ptr, std::max<size_t>(captures.size(), 1));
+  llvm::IRBuilder<> Tmp(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+  auto* env = Tmp.CreateAlloca(envTy, nullptr, "parforenv");
+  for(unsigned i = 0; i < captures.size(); ++i)
+  {
+    Builder->CreateStore(captures[i].second, Builder->CreateConstInBoundsGEP2_32(envTy, env, 0, i));
+  }
+
+  int reduction = KALANG_REDUCE_NONE;
+  if(m_reduction == tok_plus)
+  {
+    reduction = KALANG_REDUCE_ADD;
+  }
+  else if(m_reduction == tok_mult)
+  {
+    reduction = KALANG_REDUCE_MUL;
+  }
+
+  auto* i8Ptr = Builder->getInt8PtrTy();
+  auto parfor = TheModule->getOrInsertFunction("kalang_parfor",
+    llvm::FunctionType::get(i32, {i32, i32, i32, chunk->getType(), i8Ptr, i32}, false));
+  auto* result = Builder->CreateCall(parfor, {
+    startV, limitV, stepV, chunk, Builder->CreateBitCast(env, i8Ptr),
+    llvm::ConstantInt::get(i32, reduction)
+  }, "parfor");
+  for(unsigned i = 0; i < visible.size(); ++i)
+  {
+    if(!visible[i].second.address)
+    {
+      writeVariable(visible[i].second, Builder->CreateLoad(i32, captures[i].second));
+    }
+  }
+  return result;
+}
+
+bool NumberExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  value = m_numVal;
+  return eval.step();
+}
+
+bool VariableExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  return eval.step() && eval.lookup(m_sym, value);
+}
+
+// i32 arithmetic wraps around, as the generated add, sub and mul do
+static int wrap(long long value)
+{
+  return static_cast<int>(static_cast<uint32_t>(value));
 }
 
+bool BinaryExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  // the same walk as codegen
+  struct Visit
+  {
+    const ExprAST* expr;
+    bool combine;
+  };
+  std::vector<Visit> visits{{this, false}};
+  std::vector<int> values;
+  while(!visits.empty())
+  {
+    Visit visit = visits.back();
+    visits.pop_back();
+    if(!eval.step())
+    {
+      return false;
+    }
+    auto* binary = dynamic_cast<const BinaryExprAST*>(visit.expr);
+    if(!binary)
+    {
+      values.emplace_back();
+      if(!visit.expr->evaluate(eval, values.back()))
+      {
+        return false;
+      }
+      continue;
+    }
+    if(!visit.combine)
+    {
+      visits.push_back({binary, true});
+      visits.push_back({binary->m_rhs.get(), false});
+      if(binary->m_op != tok_assignment)
+      {
+        visits.push_back({binary->m_lhs.get(), false});
+      }
+      continue;
+    }
+
+    int rhs = values.back();
+    values.pop_back();
+    if(binary->m_op == tok_assignment)
+    {
+      auto* lhse = dynamic_cast<const VariableExprAST*>(binary->m_lhs.get());
+      if(!lhse || !eval.assign(lhse->getSymbol(), rhs))
+      {
+        return false;
+      }
+      values.push_back(rhs);
+      continue;
+    }
+    int lhs = values.back();
+    switch(binary->m_op)
+    {
+    case tok_plus:
+      values.back() = wrap((long long)lhs + rhs);
+      break;
+    case tok_min:
+      values.back() = wrap((long long)lhs - rhs);
+      break;
+    case tok_mult:
+      values.back() = wrap((long long)lhs * rhs);
+      break;
+    default:
+      // a comparison is an i1, which only a condition takes
+      return false;
+    }
+  }
+  value = values.back();
+  return true;
+}
+
+bool BinaryExprAST::evaluateCondition(ConstEval& eval, int& value) const
+{
+  if(m_op != tok_less)
+  {
+    return evaluate(eval, value);
+  }
+  int lhs, rhs;
+  if(!eval.step() || !m_lhs->evaluate(eval, lhs) || !m_rhs->evaluate(eval, rhs))
+  {
+    return false;
+  }
+  value = lhs < rhs;
+  return true;
+}
+
+bool CallExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  if(!eval.step())
+  {
+    return false;
+  }
+  std::vector<int> args(m_args.size());
+  for(size_t i = 0; i < m_args.size(); ++i)
+  {
+    if(!m_args[i]->evaluate(eval, args[i]))
+    {
+      return false;
+    }
+  }
+  return eval.call(m_callee, args, value);
+}
+
+bool IfExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  // codegen branches on the condition being 1, not on it being nonzero
+  int cond;
+  if(!eval.step() || !m_cond->evaluateCondition(eval, cond))
+  {
+    return false;
+  }
+  return cond == 1 ? m_then->evaluate(eval, value) : m_else->evaluate(eval, value);
+}
+
+bool ForExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  int start;
+  if(!eval.step() || !m_start->evaluate(eval, start))
+  {
+    return false;
+  }
+  ConstEval::Scope scope(eval);
+  eval.bind(m_varSym, start);
+
+  // guard, step, then body and latch, as in the rotated loop
+  int cond;
+  if(!m_end->evaluateCondition(eval, cond))
+  {
+    return false;
+  }
+  int step = 1;
+  if(cond != 0 && m_step && !m_step->evaluate(eval, step))
+  {
+    return false;
+  }
+  while(cond != 0)
+  {
+    int body, var;
+    if(!m_body->evaluateCondition(eval, body) || !eval.lookup(m_varSym, var))
+    {
+      return false;
+    }
+    eval.assign(m_varSym, wrap((long long)var + step));
+    if(!m_end->evaluateCondition(eval, cond))
+    {
+      return false;
+    }
+  }
+  value = 0;
+  return true;
+}
+
+bool VarExprAST::evaluate(ConstEval& eval, int& value) const
+{
+  if(!eval.step())
+  {
+    return false;
+  }
+  ConstEval::Scope scope(eval);
+  for(unsigned i = 0; i < m_varNames.size(); ++i)
+  {
+    int init = 0;
+    if(m_varNames[i].second && !m_varNames[i].second->evaluate(eval, init))
+    {
+      return false;
+    }
+    eval.bind(m_varSyms[i], init);
+  }
+  int body;
+  return m_body->evaluateCondition(eval, body) && m_retVal->evaluate(eval, value);
+}
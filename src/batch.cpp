@@ -0,0 +1,163 @@
+#include "batch.hpp"
+#include "consteval.hpp"
+#include "options.hpp"
+#include "parser.hpp"
+#include "runtime.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+
+struct FileResult
+{
+  std::string out;
+  std::string err;
+  bool readable = true;
+  bool done = false;
+};
+
+bool expandPaths(const std::vector<std::string>& args, std::vector<std::string>& paths)
+{
+  for(auto& arg : args)
+  {
+    if(arg[0] != '@')
+    {
+      paths.push_back(arg);
+      continue;
+    }
+    std::ifstream manifest(arg.substr(1));
+    if(!manifest.is_open())
+    {
+      printf("Error: could not open manifest %s\n", arg.c_str() + 1);
+      return false;
+    }
+    std::string line;
+    while(std::getline(manifest, line))
+    {
+      if(!line.empty())
+      {
+        paths.push_back(line);
+      }
+    }
+  }
+  return true;
+}
+
+// run one file on this thread, with its own prototypes, module and JITDylib,
+// printing into memory
+void runBatchFile(const std::string& path, unsigned index, FileResult& result)
+{
+  if(!std::ifstream(path).is_open())
+  {
+    result.readable = false;
+    result.out = "Error: could not open " + path + "\n";
+    return;
+  }
+
+  char* outBuf = nullptr;
+  char* errBuf = nullptr;
+  size_t outSize = 0, errSize = 0;
+  TheOut = open_memstream(&outBuf, &outSize);
+  TheErr = open_memstream(&errBuf, &errSize);
+
+  // nothing a file declared is seen by the next one on this thread
+  FunctionProtos.clear();
+  ConstFunctions.clear();
+  InitializeModule();
+  auto& JD = getJIT().beginRequest("batch" + std::to_string(index));
+  {
+    Parser parser;
+    parser.setWholeProgram(TheOptions.wholeProgram);
+    parser.read_file(path.c_str());
+    parser.parse();
+  }
+  if(auto Err = getJIT().removeRequestJITDylib(JD))
+  {
+    fprintf(TheOut, "Error: %s\n", llvm::toString(std::move(Err)).c_str());
+  }
+
+  fclose(TheOut);
+  fclose(TheErr);
+  TheOut = stdout;
+  TheErr = stderr;
+  result.out.assign(outBuf, outSize);
+  result.err.assign(errBuf, errSize);
+  free(outBuf);
+  free(errBuf);
+}
+
+} // namespace
+
+int runBatch(const std::vector<std::string>& args, unsigned workers)
+{
+  std::vector<std::string> paths;
+  if(!expandPaths(args, paths))
+  {
+    return 1;
+  }
+  if(paths.empty())
+  {
+    return 0;
+  }
+
+  // created before the workers start, they only share it
+  getJIT();
+
+  std::vector<FileResult> results(paths.size());
+  std::atomic<size_t> next(0);
+  std::mutex doneMutex;
+  std::condition_variable doneCond;
+
+  workers = std::max(1u, std::min<unsigned>(workers, paths.size()));
+  std::vector<std::thread> threads;
+  for(unsigned i = 0; i < workers; ++i)
+  {
+    threads.emplace_back([&] {
+      for(size_t file; (file = next++) < paths.size();)
+      {
+        FileResult result;
+        runBatchFile(paths[file], file, result);
+        std::lock_guard<std::mutex> lock(doneMutex);
+        results[file] = std::move(result);
+        results[file].done = true;
+        doneCond.notify_one();
+      }
+    });
+  }
+
+  // print in the order given, as soon as everything before is printed
+  bool failed = false;
+  for(size_t file = 0; file < paths.size(); ++file)
+  {
+    FileResult result;
+    {
+      std::unique_lock<std::mutex> lock(doneMutex);
+      doneCond.wait(lock, [&] { return results[file].done; });
+      result = std::move(results[file]);
+    }
+    if(!result.out.empty())
+    {
+      printf("==> %s <==\n%s", paths[file].c_str(), result.out.c_str());
+      fflush(stdout);
+    }
+    if(!result.err.empty())
+    {
+      fprintf(stderr, "==> %s <==\n%s", paths[file].c_str(), result.err.c_str());
+      fflush(stderr);
+    }
+    failed |= !result.readable;
+  }
+  for(auto& thread : threads)
+  {
+    thread.join();
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+#include "charscan.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define KALANG_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+// the classes of 64 bytes, one bit per byte
+struct Block
+{
+  uint64_t spaces, digits, alnums;
+};
+
+// c is in [lo, lo + span]
+inline bool inRange(unsigned char c, unsigned char lo, unsigned char span)
+{
+  return (unsigned char)(c - lo) <= span;
+}
+
+Block classifyScalar(const char* text)
+{
+  Block block = {0, 0, 0};
+  for(int i = 0; i < 64; ++i)
+  {
+    unsigned char c = text[i];
+    uint64_t bit = uint64_t(1) << i;
+    bool digit = inRange(c, '0', 9);
+    if(c == ' ' || inRange(c, '\t', '\r' - '\t'))
+    {
+      block.spaces |= bit;
+    }
+    if(digit)
+    {
+      block.digits |= bit;
+    }
+    // setting bit 5 maps upper case letters to lower case ones, and nothing
+    // else into a-z
+    if(digit || inRange(c | 0x20, 'a', 25))
+    {
+      block.alnums |= bit;
+    }
+  }
+  return block;
+}
+
+#ifdef KALANG_SCAN_X86
+
+// each byte of v in [lo, lo + span], as 0xff or 0
+inline __m128i inRange16(__m128i v, char lo, char span)
+{
+  __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(span)), offset);
+}
+
+Block classifySSE2(const char* text)
+{
+  Block block = {0, 0, 0};
+  for(int i = 0; i < 64; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(text + i));
+    __m128i digits = inRange16(v, '0', 9);
+    __m128i spaces = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), inRange16(v, '\t', '\r' - '\t'));
+    __m128i letters = inRange16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 25);
+    block.spaces |= uint64_t((uint16_t)_mm_movemask_epi8(spaces)) << i;
+    block.digits |= uint64_t((uint16_t)_mm_movemask_epi8(digits)) << i;
+    block.alnums |= uint64_t((uint16_t)_mm_movemask_epi8(_mm_or_si128(digits, letters))) << i;
+  }
+  return block;
+}
+
+__attribute__((target("avx2"))) inline __m256i inRange32(__m256i v, char lo, char span)
+{
+  __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(span)), offset);
+}
+
+__attribute__((target("avx2"))) Block classifyAVX2(const char* text)
+{
+  Block block = {0, 0, 0};
+  for(int i = 0; i < 64; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(text + i));
+    __m256i digits = inRange32(v, '0', 9);
+    __m256i spaces = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), inRange32(v, '\t', '\r' - '\t'));
+    __m256i letters = inRange32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 25);
+    block.spaces |= uint64_t((uint32_t)_mm256_movemask_epi8(spaces)) << i;
+    block.digits |= uint64_t((uint32_t)_mm256_movemask_epi8(digits)) << i;
+    block.alnums |= uint64_t((uint32_t)_mm256_movemask_epi8(_mm256_or_si256(digits, letters))) << i;
+  }
+  return block;
+}
+
+#endif
+
+typedef Block (*Classifier)(const char* text);
+
+Classifier classifierFor(ScanLevel level)
+{
+  switch(level)
+  {
+#ifdef KALANG_SCAN_X86
+    case ScanLevel::AVX2:
+      return classifyAVX2;
+    case ScanLevel::SSE2:
+      return classifySSE2;
+#endif
+    default:
+      return classifyScalar;
+  }
+}
+
+std::atomic<Classifier> CurrentClassifier(classifierFor(bestScanLevel()));
+
+} // namespace
+
+ScanLevel bestScanLevel()
+{
+#ifdef KALANG_SCAN_X86
+  // also called while static objects are constructed, maybe before libgcc
+  // has looked at the CPU
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+  {
+    return ScanLevel::AVX2;
+  }
+  return ScanLevel::SSE2;
+#else
+  return ScanLevel::Scalar;
+#endif
+}
+
+void useScanLevel(ScanLevel level)
+{
+  if(level > bestScanLevel())
+  {
+    level = bestScanLevel();
+  }
+  CurrentClassifier = classifierFor(level);
+}
+
+const char* scanLevelName(ScanLevel level)
+{
+  switch(level)
+  {
+    case ScanLevel::AVX2:
+      return "avx2";
+    case ScanLevel::SSE2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+void CharClasses::classify(const char* text, size_t size)
+{
+  size_t words = (size + 63) / 64;
+  m_size = size;
+  m_spaces.resize(words);
+  m_digits.resize(words);
+  m_alnums.resize(words);
+  Classifier classifier = CurrentClassifier;
+  for(size_t word = 0; word < words; ++word)
+  {
+    const char* block = text + word * 64;
+    // the last block is read from a copy padded with bytes in no class
+    char padded[64];
+    if(size - word * 64 < 64)
+    {
+      memset(padded, 0, sizeof(padded));
+      memcpy(padded, block, size - word * 64);
+      block = padded;
+    }
+    Block classes = classifier(block);
+    m_spaces[word] = classes.spaces;
+    m_digits[word] = classes.digits;
+    m_alnums[word] = classes.alnums;
+  }
+}
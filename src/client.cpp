@@ -0,0 +1,119 @@
+// kalang-client: send a script to a running `kalang --serve SOCKET` and print
+// what it printed, stdout first and then stderr. It links nothing from LLVM,
+// so starting it costs about as much as starting any small program.
+//
+// usage: kalang-client SOCKET [path]   (the script is read from stdin
+//                                       without a path)
+
+#include "server.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool readExactly(int fd, char* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t n = read(fd, data, size);
+    if(n == 0 || (n < 0 && errno != EINTR))
+    {
+      return false;
+    }
+    if(n > 0)
+    {
+      data += n;
+      size -= n;
+    }
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const char* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t n = write(fd, data, size);
+    if(n < 0 && errno != EINTR)
+    {
+      return false;
+    }
+    if(n > 0)
+    {
+      data += n;
+      size -= n;
+    }
+  }
+  return true;
+}
+
+// copy size bytes from the server to fd
+static bool forward(int server, int fd, size_t size)
+{
+  char buf[4096];
+  while(size)
+  {
+    size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+    if(!readExactly(server, buf, chunk) || !writeAll(fd, buf, chunk))
+    {
+      return false;
+    }
+    size -= chunk;
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc < 2 || argc > 3)
+  {
+    printf("usage: kalang-client SOCKET [path]\n");
+    return 1;
+  }
+
+  int input = STDIN_FILENO;
+  if(argc == 3 && (input = open(argv[2], O_RDONLY)) < 0)
+  {
+    printf("Error: could not open %s\n", argv[2]);
+    return 1;
+  }
+  std::string source;
+  char buf[4096];
+  ssize_t n;
+  while((n = read(input, buf, sizeof(buf))) > 0)
+  {
+    source.append(buf, n);
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server < 0 || connect(server, (sockaddr*)&addr, sizeof(addr)) < 0)
+  {
+    printf("Error: no kalang server on %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  if(!writeAll(server, source.data(), source.size()))
+  {
+    printf("Error: could not send the script\n");
+    return 1;
+  }
+  shutdown(server, SHUT_WR);
+
+  ServeReply reply;
+  if(!readExactly(server, (char*)&reply, sizeof(reply)) ||
+    !forward(server, STDOUT_FILENO, reply.outSize) ||
+    !forward(server, STDERR_FILENO, reply.errSize))
+  {
+    printf("Error: the server closed the connection early\n");
+    return 1;
+  }
+  close(server);
+  return 0;
+}
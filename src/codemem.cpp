@@ -0,0 +1,250 @@
+#include "codemem.hpp"
+
+#include "llvm/Support/Process.h"
+
+#include <cstdio>
+#include <map>
+
+PooledMemoryMapper::PooledMemoryMapper(size_t poolLimit): m_poolLimit(poolLimit) {}
+
+PooledMemoryMapper::~PooledMemoryMapper()
+{
+  for(auto& block : m_pool)
+  {
+    llvm::sys::Memory::releaseMappedMemory(block);
+  }
+}
+
+llvm::sys::MemoryBlock PooledMemoryMapper::allocateMappedMemory(
+  llvm::SectionMemoryManager::AllocationPurpose /*purpose*/, size_t numBytes,
+  const llvm::sys::MemoryBlock* const nearBlock, unsigned flags,
+  std::error_code& ec)
+{
+  size_t pageSize = llvm::sys::Process::getPageSizeEstimate();
+  size_t size = (numBytes + pageSize - 1) / pageSize * pageSize;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // the smallest pooled block that fits, close enough to nearBlock for
+    // the 32 bit relocations between the sections of an object
+    auto best = m_pool.end();
+    for(auto it = m_pool.begin(); it != m_pool.end(); ++it)
+    {
+      if(it->allocatedSize() < size ||
+        (best != m_pool.end() && it->allocatedSize() >= best->allocatedSize()))
+      {
+        continue;
+      }
+      if(nearBlock && nearBlock->base())
+      {
+        auto distance = (intptr_t)it->base() - (intptr_t)nearBlock->base();
+        if(distance > (intptr_t(1) << 30) || distance < -(intptr_t(1) << 30))
+        {
+          continue;
+        }
+      }
+      best = it;
+    }
+    if(best != m_pool.end())
+    {
+      llvm::sys::MemoryBlock block = *best;
+      *best = m_pool.back();
+      m_pool.pop_back();
+      m_pooled -= block.allocatedSize();
+      ec = llvm::sys::Memory::protectMappedMemory(block, flags);
+      return block;
+    }
+  }
+
+  auto block = llvm::sys::Memory::allocateMappedMemory(size, nearBlock, flags, ec);
+  if(!ec)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mapped += block.allocatedSize();
+  }
+  return block;
+}
+
+std::error_code PooledMemoryMapper::protectMappedMemory(const llvm::sys::MemoryBlock& block, unsigned flags)
+{
+  return llvm::sys::Memory::protectMappedMemory(block, flags);
+}
+
+std::error_code PooledMemoryMapper::releaseMappedMemory(llvm::sys::MemoryBlock& block)
+{
+  size_t size = block.allocatedSize();
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_pooled + size <= m_poolLimit)
+    {
+      // freed code must not stay executable while it waits
+      auto ec = llvm::sys::Memory::protectMappedMemory(block,
+        llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE);
+      if(!ec)
+      {
+        m_pool.push_back(block);
+        m_pooled += size;
+        block = llvm::sys::MemoryBlock();
+        return ec;
+      }
+    }
+    m_mapped -= size;
+  }
+  return llvm::sys::Memory::releaseMappedMemory(block);
+}
+
+size_t PooledMemoryMapper::mapped()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_mapped;
+}
+
+size_t PooledMemoryMapper::pooled()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_pooled;
+}
+
+thread_local CountingMemoryManager* CodeMemoryStats::t_loading = nullptr;
+
+void CodeMemoryStats::add(CountingMemoryManager* mm)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_objects[mm];
+  // RTDyldObjectLinkingLayer loads the object on the thread that created
+  // its memory manager, and only then tells us whose it is
+  t_loading = mm;
+}
+
+void CodeMemoryStats::remove(CountingMemoryManager* mm)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_objects.erase(mm);
+  if(t_loading == mm)
+  {
+    t_loading = nullptr;
+  }
+}
+
+void CodeMemoryStats::count(CountingMemoryManager* mm, const CodeMemoryUsage& usage)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto& object = m_objects[mm];
+  object.usage.code += usage.code;
+  object.usage.data += usage.data;
+  object.usage.metadata += usage.metadata;
+}
+
+void CodeMemoryStats::claim(llvm::orc::MaterializationResponsibility& R)
+{
+  if(!t_loading)
+  {
+    return;
+  }
+  auto* mm = t_loading;
+  t_loading = nullptr;
+  llvm::consumeError(R.withResourceKeyDo([&](llvm::orc::ResourceKey key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto& object = m_objects[mm];
+    object.jd = &R.getTargetJITDylib();
+    object.key = key;
+  }));
+}
+
+static void printUsage(const char* label, size_t objects, const CodeMemoryUsage& usage)
+{
+  printf("%s: %zu objects, %zu bytes of code, %zu of data, %zu of metadata\n",
+    label, objects, usage.code, usage.data, usage.metadata);
+}
+
+void CodeMemoryStats::print(PooledMemoryMapper& mapper,
+  const std::unordered_map<llvm::orc::ResourceKey, std::string>& names)
+{
+  struct Total
+  {
+    size_t objects = 0;
+    CodeMemoryUsage usage;
+
+    void add(const CodeMemoryUsage& other)
+    {
+      ++objects;
+      usage.code += other.code;
+      usage.data += other.data;
+      usage.metadata += other.metadata;
+    }
+  };
+
+  // ordered, so the report reads the same every time
+  Total all;
+  std::map<std::string, std::pair<Total, std::map<std::string, Total>>> byDylib;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(auto& entry : m_objects)
+    {
+      const Object& object = entry.second;
+      all.add(object.usage);
+      std::string dylib = object.jd ? object.jd->getName() : "(loading)";
+      std::string tracker;
+      auto name = names.find(object.key);
+      if(name != names.end())
+      {
+        tracker = name->second;
+      }
+      else
+      {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "tracker %#zx", (size_t)object.key);
+        tracker = buf;
+      }
+      auto& dylibTotal = byDylib[dylib];
+      dylibTotal.first.add(object.usage);
+      dylibTotal.second[tracker].add(object.usage);
+    }
+  }
+
+  printUsage("code memory", all.objects, all.usage);
+  printf("%zu bytes mapped, %zu of them kept for reuse\n", mapper.mapped(), mapper.pooled());
+  for(auto& dylib : byDylib)
+  {
+    printUsage(dylib.first.c_str(), dylib.second.first.objects, dylib.second.first.usage);
+    for(auto& tracker : dylib.second.second)
+    {
+      printUsage(("  " + tracker.first).c_str(), tracker.second.objects, tracker.second.usage);
+    }
+  }
+}
+
+CountingMemoryManager::CountingMemoryManager(PooledMemoryMapper& mapper, CodeMemoryStats& stats):
+  llvm::SectionMemoryManager(&mapper), m_stats(stats)
+{
+  m_stats.add(this);
+}
+
+CountingMemoryManager::~CountingMemoryManager()
+{
+  m_stats.remove(this);
+}
+
+uint8_t* CountingMemoryManager::allocateCodeSection(uintptr_t size, unsigned alignment,
+  unsigned sectionID, llvm::StringRef sectionName)
+{
+  CodeMemoryUsage usage;
+  usage.code = size;
+  m_stats.count(this, usage);
+  return llvm::SectionMemoryManager::allocateCodeSection(size, alignment, sectionID, sectionName);
+}
+
+uint8_t* CountingMemoryManager::allocateDataSection(uintptr_t size, unsigned alignment,
+  unsigned sectionID, llvm::StringRef sectionName, bool isReadOnly)
+{
+  CodeMemoryUsage usage;
+  if(sectionName.startswith(".eh_frame") || sectionName.startswith(".debug"))
+  {
+    usage.metadata = size;
+  }
+  else
+  {
+    usage.data = size;
+  }
+  m_stats.count(this, usage);
+  return llvm::SectionMemoryManager::allocateDataSection(size, alignment, sectionID, sectionName, isReadOnly);
+}
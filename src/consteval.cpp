@@ -0,0 +1,116 @@
+#include "consteval.hpp"
+#include "ast.hpp"
+#include "options.hpp"
+#include "profile.hpp"
+
+thread_local std::unordered_map<std::string, ConstFunction> ConstFunctions;
+
+// whether calls in the function being generated are folded
+static thread_local bool t_folding = true;
+
+ConstEval::ConstEval(): m_fuel(TheOptions.constEvalFuel) {}
+
+bool ConstEval::lookup(Symbol sym, int& value) const
+{
+  for(size_t i = m_vars.size(); i > m_frame; --i)
+  {
+    if(m_vars[i - 1].first == sym)
+    {
+      value = m_vars[i - 1].second;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ConstEval::assign(Symbol sym, int value)
+{
+  for(size_t i = m_vars.size(); i > m_frame; --i)
+  {
+    if(m_vars[i - 1].first == sym)
+    {
+      m_vars[i - 1].second = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ConstEval::call(const std::string& callee, const std::vector<int>& args, int& value)
+{
+  auto it = ConstFunctions.find(callee);
+  if(it == ConstFunctions.end() || it->second.params.size() != args.size() ||
+    m_depth >= TheOptions.constEvalDepth)
+  {
+    return false;
+  }
+  const ConstFunction* function = &it->second;
+  auto key = std::make_pair(function, args);
+  auto known = m_results.find(key);
+  if(known != m_results.end())
+  {
+    value = known->second;
+    return true;
+  }
+
+  // the callee sees its parameters and nothing of the caller
+  Scope scope(*this);
+  size_t callerFrame = m_frame;
+  m_frame = m_vars.size();
+  for(size_t i = 0; i < args.size(); ++i)
+  {
+    bind(function->params[i], args[i]);
+  }
+  ++m_depth;
+  bool ok = function->body->evaluate(*this, value);
+  --m_depth;
+  m_frame = callerFrame;
+  if(ok)
+  {
+    m_results.emplace(std::move(key), value);
+  }
+  return ok;
+}
+
+static bool isAnonymous(const std::string& name)
+{
+  return name.compare(0, 11, "__anon_expr") == 0;
+}
+
+void beginConstDefinition(const PrototypeAST& proto, std::shared_ptr<const ExprAST> body)
+{
+  // a function that can be redefined keeps calling whatever its callees are
+  // at run time, only expressions, which run right away, use their bodies now.
+  // A training run has to execute the instrumented calls to count them.
+  t_folding = TheOptions.constEvalFuel != 0 && !TheProfile.isGenerating() &&
+    (!TheOptions.redefine || isAnonymous(proto.getName()));
+  if(isAnonymous(proto.getName()))
+  {
+    return;
+  }
+  ConstFunction& function = ConstFunctions[proto.getName()];
+  function.params.clear();
+  for(unsigned i = 0; i < proto.getNumArgs(); ++i)
+  {
+    function.params.push_back(proto.getArgSymbol(i));
+  }
+  function.body = std::move(body);
+}
+
+bool foldCall(const std::string& callee, const std::vector<std::unique_ptr<ExprAST>>& args, int& value)
+{
+  if(!t_folding || ConstFunctions.find(callee) == ConstFunctions.end())
+  {
+    return false;
+  }
+  ConstEval eval;
+  std::vector<int> argValues(args.size());
+  for(size_t i = 0; i < args.size(); ++i)
+  {
+    if(!args[i]->evaluate(eval, argValues[i]))
+    {
+      return false;
+    }
+  }
+  return eval.call(callee, argValues, value);
+}
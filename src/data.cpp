@@ -0,0 +1,115 @@
+#include "data.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+struct Array
+{
+  const int32_t* elements;
+  int32_t length;
+};
+
+// arrays are only added before anything runs, so that JIT'd code on any
+// thread reads them without a lock
+std::vector<Array> arrays;
+
+// maps the files listed in KALANG_DATA, for a program compiled from dump.ll
+// as much as for kalang itself
+struct MapEnvironment
+{
+  MapEnvironment()
+  {
+    const char* list = getenv("KALANG_DATA");
+    if(!list || !*list)
+    {
+      return;
+    }
+    std::string paths(list);
+    size_t start = 0;
+    while(start <= paths.size())
+    {
+      size_t end = paths.find(':', start);
+      if(end == std::string::npos)
+      {
+        end = paths.size();
+      }
+      std::string path = paths.substr(start, end - start);
+      if(kalang_data_map(path.c_str()) < 0)
+      {
+        fprintf(stderr, "Error: cannot map %s: %s\n", path.c_str(), strerror(errno));
+        exit(1);
+      }
+      start = end + 1;
+    }
+  }
+} mapEnvironment;
+
+} // namespace
+
+extern "C" int32_t kalang_data_map(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+  {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  Array array{nullptr, 0};
+  uint64_t length = static_cast<uint64_t>(st.st_size) / sizeof(int32_t);
+  array.length = static_cast<int32_t>(length < INT32_MAX ? length : INT32_MAX);
+  if(array.length > 0)
+  {
+    // only the whole elements that can be indexed, the mapping outlives fd
+    void* mapped = mmap(nullptr, array.length * sizeof(int32_t), PROT_READ, MAP_PRIVATE, fd, 0);
+    if(mapped == MAP_FAILED)
+    {
+      int saved = errno;
+      close(fd);
+      errno = saved;
+      return -1;
+    }
+    array.elements = static_cast<const int32_t*>(mapped);
+  }
+  close(fd);
+  arrays.push_back(array);
+  return static_cast<int32_t>(arrays.size() - 1);
+}
+
+extern "C" const int32_t* kalang_data_elements(int32_t array)
+{
+  if(array < 0 || static_cast<size_t>(array) >= arrays.size())
+  {
+    return nullptr;
+  }
+  return arrays[array].elements;
+}
+
+extern "C" int32_t kalang_data_length(int32_t array)
+{
+  if(array < 0 || static_cast<size_t>(array) >= arrays.size())
+  {
+    return 0;
+  }
+  return arrays[array].length;
+}
@@ -0,0 +1,47 @@
+// kalang-executor: runs the code `kalang --executors N` compiles, in a process
+// of its own, so that a program that crashes takes down only its executor.
+// The controller starts it with the two ends of a pipe pair and talks ORC's
+// simple remote EPC protocol over them: it allocates and writes memory here,
+// registers EH frames and runs functions. The kalang runtime (parfor and the
+// data arrays, mapped from KALANG_DATA) is linked in and exported, for JIT'd
+// code to find like any other symbol of this process.
+//
+// usage: kalang-executor IN_FD OUT_FD
+
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorDylibManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Error.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+int main(int argc, char** argv)
+{
+  if(argc != 3)
+  {
+    fprintf(stderr, "usage: kalang-executor IN_FD OUT_FD\n");
+    return 1;
+  }
+  int inFD = atoi(argv[1]);
+  int outFD = atoi(argv[2]);
+
+  ExitOnError ExitOnErr("kalang-executor: ");
+  sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+  auto Server = ExitOnErr(SimpleRemoteEPCServer::Create<FDSimpleRemoteEPCTransport>(
+    [](SimpleRemoteEPCServer::Setup& S) -> Error {
+      S.setDispatcher(std::make_unique<SimpleRemoteEPCServer::ThreadDispatcher>());
+      S.bootstrapSymbols() = SimpleRemoteEPCServer::defaultBootstrapSymbols();
+      S.services().push_back(std::make_unique<rt_bootstrap::SimpleExecutorMemoryManager>());
+      S.services().push_back(std::make_unique<rt_bootstrap::SimpleExecutorDylibManager>());
+      return Error::success();
+    },
+    inFD, outFD
+  ));
+  ExitOnErr(Server->waitForDisconnect());
+  return 0;
+}
@@ -0,0 +1,257 @@
+#include "layout.hpp"
+#include "profile.hpp"
+
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/Transforms/IPO/HotColdSplitting.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+
+// Clusters stop growing at about a page of code, so that a hot call chain
+// takes one iTLB entry. Sizes are counted in IR instructions, 4 bytes each.
+const unsigned ClusterLimit = 1024;
+
+struct Cluster
+{
+  std::vector<llvm::Function*> functions;
+  uint64_t count = 0;
+  unsigned size = 0;
+};
+
+void setProfileSummary(llvm::Module& M)
+{
+  llvm::InstrProfSummaryBuilder builder(llvm::ProfileSummaryBuilder::DefaultCutoffs);
+  for(auto& entry : TheProfile.counts())
+  {
+    // the entry count first, then the block counts
+    std::vector<uint64_t> counts{entry.second.entry};
+    for(auto& branch : entry.second.branches)
+    {
+      counts.push_back(branch.first);
+      counts.push_back(branch.second);
+    }
+    builder.addRecord(llvm::InstrProfRecord(std::move(counts)));
+  }
+  M.setProfileSummary(builder.getSummary()->getMD(M.getContext()), llvm::ProfileSummary::PSK_Instr);
+}
+
+// The highest count of F, its entry or any of its branches. A function
+// called once can still run a hot loop.
+uint64_t peakCount(const llvm::Function& F)
+{
+  auto counts = TheProfile.counts().find(F.getName().str());
+  if(counts == TheProfile.counts().end())
+  {
+    return 0;
+  }
+  uint64_t peak = counts->second.entry;
+  for(auto& branch : counts->second.branches)
+  {
+    peak = std::max({peak, branch.first, branch.second});
+  }
+  return peak;
+}
+
+// outline the blocks the profile never saw run into functions of their own
+void splitColdRegions(llvm::Module& M, llvm::ProfileSummaryInfo& PSI)
+{
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  llvm::ModulePassManager MPM;
+  MPM.addPass(llvm::HotColdSplittingPass());
+  MPM.run(M, MAM);
+
+  // the pass marks a function cold whole when its entry is, undo that for
+  // the ones whose loops are hot
+  for(auto& F : M)
+  {
+    if(!F.isDeclaration() && PSI.isHotCount(peakCount(F)))
+    {
+      F.removeFnAttr(llvm::Attribute::Cold);
+      F.removeFnAttr(llvm::Attribute::MinSize);
+    }
+  }
+}
+
+uint64_t entryCount(const llvm::Function& F)
+{
+  auto count = F.getEntryCount();
+  return count ? count->getCount() : 0;
+}
+
+// A function with no count of its own (a parfor body) follows the function
+// that refers to it.
+llvm::Function* owner(llvm::Function& F)
+{
+  for(auto* user : F.users())
+  {
+    if(auto* inst = llvm::dyn_cast<llvm::Instruction>(user))
+    {
+      return inst->getFunction();
+    }
+  }
+  return nullptr;
+}
+
+// The order of the functions that ran, after C3 (Ottoni and Maher, "Optimizing
+// function placement for large-scale data-center applications"): from the
+// hottest function down, the cluster of each is appended to the cluster of
+// its most frequent caller while both fit in a page. Clusters are then sorted
+// by calls per instruction.
+std::vector<llvm::Function*> orderHotFunctions(llvm::Module& M, const std::vector<llvm::Function*>& hot)
+{
+  std::unordered_map<llvm::Function*, std::pair<llvm::Function*, uint64_t>> heaviestCaller;
+  for(auto& entry : TheProfile.counts())
+  {
+    auto* caller = M.getFunction(entry.first);
+    if(!caller || caller->isDeclaration())
+    {
+      continue;
+    }
+    for(auto& call : entry.second.calls)
+    {
+      auto* callee = M.getFunction(call.first);
+      if(!callee || callee == caller || callee->isDeclaration())
+      {
+        continue;
+      }
+      auto& best = heaviestCaller[callee];
+      if(call.second > best.second)
+      {
+        best = {caller, call.second};
+      }
+    }
+  }
+
+  std::vector<Cluster> clusters(hot.size());
+  std::unordered_map<llvm::Function*, size_t> clusterOf;
+  for(size_t i = 0; i < hot.size(); ++i)
+  {
+    clusters[i].functions.push_back(hot[i]);
+    clusters[i].count = entryCount(*hot[i]);
+    clusters[i].size = std::max(1u, hot[i]->getInstructionCount());
+    clusterOf[hot[i]] = i;
+  }
+  for(auto* F : hot)
+  {
+    auto caller = heaviestCaller.find(F);
+    if(caller == heaviestCaller.end() || !clusterOf.count(caller->second.first))
+    {
+      continue;
+    }
+    size_t from = clusterOf[F];
+    size_t into = clusterOf[caller->second.first];
+    if(from == into || clusters[from].size + clusters[into].size > ClusterLimit)
+    {
+      continue;
+    }
+    for(auto* moved : clusters[from].functions)
+    {
+      clusterOf[moved] = into;
+    }
+    auto& target = clusters[into];
+    target.functions.insert(target.functions.end(), clusters[from].functions.begin(), clusters[from].functions.end());
+    target.count += clusters[from].count;
+    target.size += clusters[from].size;
+    clusters[from] = Cluster();
+  }
+
+  std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+    return (double)a.count / std::max(1u, a.size) > (double)b.count / std::max(1u, b.size);
+  });
+  std::vector<llvm::Function*> order;
+  for(auto& cluster : clusters)
+  {
+    order.insert(order.end(), cluster.functions.begin(), cluster.functions.end());
+  }
+  return order;
+}
+
+} // namespace
+
+void layoutProgram(llvm::Module& M)
+{
+  setProfileSummary(M);
+  llvm::ProfileSummaryInfo PSI(M);
+  splitColdRegions(M, PSI);
+
+  std::vector<llvm::Function*> hot, cold, unknown;
+  for(auto& F : M)
+  {
+    if(F.isDeclaration())
+    {
+      continue;
+    }
+    if(!F.getEntryCount())
+    {
+      unknown.push_back(&F);
+    }
+    else if(entryCount(F) > 0)
+    {
+      hot.push_back(&F);
+    }
+    else
+    {
+      cold.push_back(&F);
+    }
+  }
+  std::stable_sort(hot.begin(), hot.end(), [](llvm::Function* a, llvm::Function* b) {
+    return entryCount(*a) > entryCount(*b);
+  });
+  std::vector<llvm::Function*> order = orderHotFunctions(M, hot);
+  for(auto* F : unknown)
+  {
+    auto* parent = owner(*F);
+    auto at = std::find(order.begin(), order.end(), parent);
+    if(at != order.end())
+    {
+      order.insert(at + 1, F);
+    }
+    else
+    {
+      cold.push_back(F);
+    }
+  }
+
+  for(auto* F : order)
+  {
+    auto* counted = F;
+    while(counted && !counted->getEntryCount())
+    {
+      counted = owner(*counted);
+    }
+    if(counted && (PSI.isFunctionEntryHot(counted) || PSI.isHotCount(peakCount(*counted))))
+    {
+      F->setSectionPrefix("hot");
+    }
+  }
+  for(auto* F : cold)
+  {
+    if(F->getEntryCount() || F->hasFnAttribute(llvm::Attribute::Cold))
+    {
+      F->setSectionPrefix("unlikely");
+    }
+  }
+  order.insert(order.end(), cold.begin(), cold.end());
+  auto& functions = M.getFunctionList();
+  for(auto* F : order)
+  {
+    functions.splice(functions.end(), functions, F->getIterator());
+  }
+}
@@ -2,16 +2,41 @@
 #include "parser.hpp"
 #include "jit.hpp"
 #include "runtime.hpp"
+#include "options.hpp"
+#include "profile.hpp"
+#include "server.hpp"
+#include "batch.hpp"
+#include "layout.hpp"
+#include "data.hpp"
+#include "stream.hpp"
+#include "remote.hpp"
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <map>
 
 
+// whether line is the REPL command name, followed by nothing or by a space
+// and rest
+static bool replCommand(const std::string& line, const char* name, std::string& rest)
+{
+  size_t len = strlen(name);
+  if(line.compare(0, len, name) != 0 || (line.size() > len && line[len] != ' '))
+  {
+    return false;
+  }
+  rest = line.size() > len ? line.substr(len + 1) : "";
+  return true;
+}
+
 static void repl()
 {
   while(1)
   {
     Parser parser; // reset parser state
+    parser.setInlineImports(TheOptions.inlineImports);
     printf("REPL> ");
     parser.read_line();
     if(std::cin.eof())
@@ -19,6 +44,19 @@ static void repl()
       printf("\n");
       break;
     }
+    std::string line = parser.get_source();
+    std::string rest;
+    if(line == ":mem")
+    {
+      getJIT().printCodeMemory();
+      continue;
+    }
+    if(replCommand(line, ":time", rest) || replCommand(line, ":bench", rest))
+    {
+      parser.read_source(rest);
+      parser.measure(line[1] == 'b');
+      continue;
+    }
     parser.parse();
   }
   return;
@@ -27,12 +65,20 @@ static void repl()
 void runFile(const char* fileName)
 {
   Parser parser;
+  InitializeProgram();
+  parser.setWholeProgram(TheOptions.wholeProgram);
+  parser.setInlineImports(TheOptions.inlineImports);
+  parser.setEmitOnly(TheOptions.emitOnly);
   parser.read_file(fileName);
   parser.parse();
+  if(TheProfile.isUsing())
+  {
+    layoutProgram(*TheProgram);
+  }
 
   std::string Str;
   llvm::raw_string_ostream OS(Str);
-  OS << *TheModule;
+  OS << *TheProgram;
   OS.flush();
 
   std::ofstream myfile;
@@ -41,27 +87,127 @@ void runFile(const char* fileName)
   myfile.close();
 }
 
+// whether the options and paths go together
+static bool checkUsage(const std::vector<std::string>& positional)
+{
+  if(TheOptions.batch)
+  {
+    // files of a batch run apart, nothing that would be shared between them
+    return !positional.empty() && !TheOptions.emitOnly && !TheOptions.lazy &&
+      !TheOptions.inlineImports && TheOptions.serve.empty() &&
+      TheOptions.profileGenerate.empty() && TheOptions.profileUse.empty() &&
+      TheOptions.map.empty() && !TheOptions.executors;
+  }
+  if(TheOptions.executors)
+  {
+    // executors link objects as they are, without the stubs of lazy and
+    // redefinable functions or counters at addresses of this process
+    return positional.size() == 1 && TheOptions.map.empty() && TheOptions.serve.empty() &&
+      !TheOptions.emitOnly && !TheOptions.lazy && !TheOptions.perf &&
+      TheOptions.profileGenerate.empty();
+  }
+  if(!TheOptions.map.empty())
+  {
+    // the function is looked up in the file's JITDylib after it ran
+    return positional.size() == 1 && TheOptions.serve.empty() && !TheOptions.wholeProgram &&
+      !TheOptions.emitOnly;
+  }
+  if(TheOptions.mapBinary)
+  {
+    return false;
+  }
+  if(!TheOptions.serve.empty())
+  {
+    // bodies kept for inlining would outlive the request that defined them
+    return positional.size() <= 1 && !TheOptions.wholeProgram && !TheOptions.emitOnly &&
+      !TheOptions.inlineImports;
+  }
+  if(TheOptions.wholeProgram || TheOptions.emitOnly)
+  {
+    return positional.size() == 1;
+  }
+  return positional.size() <= 1;
+}
+
 int main(int argc, char** argv)
 {
-  
+  std::vector<std::string> positional;
+  if(!parseOptions(argc, argv, positional) || !checkUsage(positional))
+  {
+    printUsage();
+    return 1;
+  }
+
+  if(!TheOptions.profileUse.empty() && !TheProfile.load(TheOptions.profileUse))
+  {
+    return 1;
+  }
+  TheProfile.setGenerate(!TheOptions.profileGenerate.empty());
+  for(auto& path : TheOptions.dataFiles)
+  {
+    if(kalang_data_map(path.c_str()) < 0)
+    {
+      printf("Error: cannot map %s: %s\n", path.c_str(), strerror(errno));
+      return 1;
+    }
+  }
+
   llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
-  TheJIT = ExitOnErr(llvm::orc::KalangJIT::Create());
- 
+  // speculative compiles only pay off when they run beside the caller
+  if(TheOptions.speculate && !TheOptions.compileThreads)
+  {
+    TheOptions.compileThreads = llvm::hardware_concurrency().compute_thread_count();
+  }
   InitializeModule();
+  if(TheOptions.executors)
+  {
+    TheExecutors = std::make_unique<ExecutorPool>();
+    if(!TheExecutors->start(TheOptions.executors))
+    {
+      return 1;
+    }
+  }
 
-  if(argc == 1)
+  if(TheOptions.batch)
   {
+    int status = runBatch(positional,
+      TheOptions.workers ? TheOptions.workers : llvm::hardware_concurrency().compute_thread_count());
+    fflush(stdout);
+    fflush(stderr);
+    std::_Exit(status);
+  }
+  if(!TheOptions.serve.empty())
+  {
+    return serve(TheOptions.serve.c_str(), positional.empty() ? nullptr : positional[0].c_str());
+  }
+  int status = 0;
+  if(positional.empty())
+  {
+    // functions are redefined all the time while trying things out
+    TheOptions.redefine = true;
     repl();
   }
-  else if(argc == 2)
+  else if(!TheOptions.map.empty())
+  {
+    // stdout only gets the results
+    TheOut = stderr;
+    runFile(positional[0].c_str());
+    status = runMap(TheOptions.map, TheOptions.mapBinary);
+  }
+  else
   {
-    runFile(argv[1]);
+    runFile(positional[0].c_str());
   }
-  else {
-    printf("Error, usage: ./kalang [path]\n");
+
+  if(TheProfile.isGenerating() && !TheProfile.save(TheOptions.profileGenerate))
+  {
     return 1;
   }
-  return 0;
+
+  // Skip tearing down the JIT, the OS takes the memory back anyway. Freeing
+  // every object deregisters its EH frames one by one, which libgcc does in
+  // time quadratic in the number of objects.
+  fflush(stdout);
+  fflush(stderr);
+  std::_Exit(status);
 }
@@ -0,0 +1,182 @@
+#include "options.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+KalangOptions TheOptions;
+
+// match "--name=value" or "--name value", advancing i in the latter case
+static bool flagValue(int argc, char** argv, int& i, const char* name, std::string& value)
+{
+  size_t len = strlen(name);
+  if(strncmp(argv[i], name, len) != 0)
+  {
+    return false;
+  }
+  if(argv[i][len] == '=')
+  {
+    value = argv[i] + len + 1;
+    return true;
+  }
+  if(argv[i][len] == '\0' && i + 1 < argc)
+  {
+    value = argv[++i];
+    return true;
+  }
+  return false;
+}
+
+static bool parseUnsigned(const std::string& text, unsigned& out)
+{
+  char* end = nullptr;
+  unsigned long val = strtoul(text.c_str(), &end, 10);
+  if(text.empty() || *end != '\0')
+  {
+    return false;
+  }
+  out = static_cast<unsigned>(val);
+  return true;
+}
+
+bool parseOptions(int argc, char** argv, std::vector<std::string>& positional)
+{
+  for(int i = 1; i < argc; ++i)
+  {
+    std::string value;
+    if(flagValue(argc, argv, i, "--jobs", value) || flagValue(argc, argv, i, "-j", value))
+    {
+      if(!parseUnsigned(value, TheOptions.compileThreads))
+      {
+        printf("Error: --jobs expects a number\n");
+        return false;
+      }
+    }
+    else if(flagValue(argc, argv, i, "--profile-generate", value))
+    {
+      TheOptions.profileGenerate = value;
+    }
+    else if(flagValue(argc, argv, i, "--profile-use", value))
+    {
+      TheOptions.profileUse = value;
+    }
+    else if(flagValue(argc, argv, i, "--consteval-fuel", value))
+    {
+      if(!parseUnsigned(value, TheOptions.constEvalFuel))
+      {
+        printf("Error: --consteval-fuel expects a number\n");
+        return false;
+      }
+    }
+    else if(flagValue(argc, argv, i, "--consteval-depth", value))
+    {
+      if(!parseUnsigned(value, TheOptions.constEvalDepth))
+      {
+        printf("Error: --consteval-depth expects a number\n");
+        return false;
+      }
+    }
+    else if(flagValue(argc, argv, i, "--workers", value))
+    {
+      if(!parseUnsigned(value, TheOptions.workers))
+      {
+        printf("Error: --workers expects a number\n");
+        return false;
+      }
+    }
+    else if(strcmp(argv[i], "--batch") == 0)
+    {
+      TheOptions.batch = true;
+    }
+    else if(flagValue(argc, argv, i, "--executors", value))
+    {
+      if(!parseUnsigned(value, TheOptions.executors))
+      {
+        printf("Error: --executors expects a number\n");
+        return false;
+      }
+    }
+    else if(strcmp(argv[i], "--map-binary") == 0)
+    {
+      TheOptions.mapBinary = true;
+    }
+    else if(flagValue(argc, argv, i, "--map", value))
+    {
+      TheOptions.map = value;
+    }
+    else if(flagValue(argc, argv, i, "--data", value))
+    {
+      TheOptions.dataFiles.push_back(value);
+    }
+    else if(flagValue(argc, argv, i, "--serve", value))
+    {
+      TheOptions.serve = value;
+    }
+    else if(strcmp(argv[i], "--perf") == 0)
+    {
+      TheOptions.perf = true;
+    }
+    else if(strcmp(argv[i], "--lazy") == 0)
+    {
+      TheOptions.lazy = true;
+    }
+    else if(strcmp(argv[i], "--speculate") == 0)
+    {
+      TheOptions.lazy = true;
+      TheOptions.speculate = true;
+    }
+    else if(strcmp(argv[i], "--whole-program") == 0)
+    {
+      TheOptions.wholeProgram = true;
+    }
+    else if(strcmp(argv[i], "--inline-imports") == 0)
+    {
+      TheOptions.inlineImports = true;
+    }
+    else if(strcmp(argv[i], "--ssa") == 0)
+    {
+      TheOptions.ssa = true;
+    }
+    else if(strcmp(argv[i], "--emit-llvm") == 0)
+    {
+      TheOptions.emitOnly = true;
+    }
+    else if(argv[i][0] == '-' && argv[i][1] != '\0')
+    {
+      printf("Error: unknown option %s\n", argv[i]);
+      return false;
+    }
+    else
+    {
+      positional.push_back(argv[i]);
+    }
+  }
+  return true;
+}
+
+void printUsage()
+{
+  printf("Error, usage: ./kalang [options] [path]\n");
+  printf("       ./kalang --batch [options] path|@manifest...\n");
+  printf("options:\n");
+  printf("  -j, --jobs N               compile on N background threads while executing\n");
+  printf("  --profile-generate FILE    count function entries and branches, save them to FILE\n");
+  printf("  --profile-use FILE         optimize with the counts saved in FILE\n");
+  printf("  --perf                     write /tmp/perf-<pid>.map and a jitdump for perf\n");
+  printf("  --lazy                     compile each fungsi on its first call\n");
+  printf("  --speculate                --lazy, and compile callees in the background early\n");
+  printf("  --whole-program            optimize a file as one module, inlining across functions\n");
+  printf("  --inline-imports           inline small earlier definitions into later ones\n");
+  printf("  --ssa                      generate variables in SSA form, without allocas\n");
+  printf("  --emit-llvm                only write dump.ll, without starting the JIT\n");
+  printf("  --consteval-fuel N         steps to fold a call with constant arguments (10000 by default),\n");
+  printf("                             0 is off, and so is --profile-generate\n");
+  printf("  --consteval-depth N        calls nested while folding such a call (256 by default)\n");
+  printf("  --executors N              run top level expressions in N kalang-executor processes\n");
+  printf("  --map NAME                 after running path, apply fungsi NAME to each record of stdin\n");
+  printf("  --map-binary               --map records and results are binary i32, not text\n");
+  printf("  --data FILE                map FILE as the next array for ambil and panjang\n");
+  printf("  --batch                    run every path (or @manifest) on its own, concurrently\n");
+  printf("  --workers N                threads running --batch files, one per core by default\n");
+  printf("  --serve SOCKET             run scripts sent by kalang-client, path is a shared prelude\n");
+}
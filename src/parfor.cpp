@@ -0,0 +1,264 @@
+#include "parfor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// one call of kalang_parfor
+struct Job
+{
+  KalangParforChunk chunk;
+  void* env;
+  int64_t start, limit, step;
+  int32_t reduction;
+  // tasks with more iterations than this are split before they run
+  int64_t grain;
+  // iterations not finished yet
+  std::atomic<int64_t> remaining;
+  std::mutex resultMutex;
+  int32_t result;
+};
+
+// the iterations with numbers in [begin, end) of a job
+struct Task
+{
+  Job* job;
+  int64_t begin, end;
+};
+
+int32_t identity(int32_t reduction)
+{
+  return reduction == KALANG_REDUCE_MUL ? 1 : 0;
+}
+
+// wraps around like kalang's own arithmetic
+int32_t combine(int32_t reduction, int32_t a, int32_t b)
+{
+  switch(reduction)
+  {
+    case KALANG_REDUCE_ADD:
+      return (int32_t)((uint32_t)a + (uint32_t)b);
+    case KALANG_REDUCE_MUL:
+      return (int32_t)((uint32_t)a * (uint32_t)b);
+    default:
+      return 0;
+  }
+}
+
+// Every thread owns a deque of tasks. It pushes and pops at the back, so it
+// keeps working on the ranges it split last, while idle threads steal from the
+// front, where the largest ranges are. Threads waiting for their own loop to
+// finish run tasks too, which lets a parfor body run another parfor.
+class WorkStealingPool
+{
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // one queue per pool thread, the last one is shared by outside threads
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+  std::atomic<int64_t> m_queued;
+  std::mutex m_sleepMutex;
+  std::condition_variable m_wake;
+  bool m_stop;
+
+  static thread_local int t_queue;
+
+  Queue& ownQueue()
+  {
+    return *m_queues[t_queue >= 0 ? t_queue : m_queues.size() - 1];
+  }
+
+  void push(const Task& task)
+  {
+    {
+      Queue& queue = ownQueue();
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(task);
+    }
+    ++m_queued;
+    // a thread about to sleep has either seen m_queued or is waiting now
+    {
+      std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_wake.notify_one();
+  }
+
+  bool pop(Task& task)
+  {
+    size_t own = t_queue >= 0 ? t_queue : m_queues.size() - 1;
+    for(size_t i = 0; i < m_queues.size(); ++i)
+    {
+      Queue& queue = *m_queues[(own + i) % m_queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if(queue.tasks.empty())
+      {
+        continue;
+      }
+      if(i == 0)
+      {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+      }
+      else
+      {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+      }
+      --m_queued;
+      return true;
+    }
+    return false;
+  }
+
+  void run(Task task)
+  {
+    Job& job = *task.job;
+    // leave the upper halves for others to steal
+    while(task.end - task.begin > job.grain)
+    {
+      int64_t mid = task.begin + (task.end - task.begin) / 2;
+      push({&job, mid, task.end});
+      task.end = mid;
+    }
+
+    int64_t first = job.start + task.begin * job.step;
+    int64_t limit = std::min(job.limit, job.start + task.end * job.step);
+    int32_t value = job.chunk(job.env, (int32_t)first, (int32_t)limit, (int32_t)job.step);
+    {
+      std::lock_guard<std::mutex> lock(job.resultMutex);
+      job.result = combine(job.reduction, job.result, value);
+    }
+    // the job may be gone as soon as remaining reaches 0
+    if((job.remaining -= task.end - task.begin) == 0)
+    {
+      // its caller may be asleep in runJob, like in push
+      {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+      }
+      m_wake.notify_all();
+    }
+  }
+
+  void work(int index)
+  {
+    t_queue = index;
+    while(true)
+    {
+      Task task;
+      if(pop(task))
+      {
+        run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m_sleepMutex);
+      m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+      if(m_stop)
+      {
+        return;
+      }
+    }
+  }
+
+public:
+  explicit WorkStealingPool(unsigned threads): m_queued(0), m_stop(false)
+  {
+    for(unsigned i = 0; i <= threads; ++i)
+    {
+      m_queues.push_back(std::make_unique<Queue>());
+    }
+    for(unsigned i = 0; i < threads; ++i)
+    {
+      m_threads.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~WorkStealingPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_sleepMutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for(auto& thread : m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  // threads running iterations, the caller included
+  unsigned size() const { return m_threads.size() + 1; }
+
+  void runJob(Job& job, int64_t trips)
+  {
+    push({&job, 0, trips});
+    while(job.remaining > 0)
+    {
+      Task task;
+      if(pop(task))
+      {
+        run(task);
+        continue;
+      }
+      // the rest runs on other threads, sleep until it is done or a task
+      // comes up to help with
+      std::unique_lock<std::mutex> lock(m_sleepMutex);
+      m_wake.wait(lock, [&] { return job.remaining == 0 || m_queued > 0; });
+    }
+  }
+};
+
+thread_local int WorkStealingPool::t_queue = -1;
+
+WorkStealingPool& pool()
+{
+  static WorkStealingPool instance([] {
+    unsigned threads = std::thread::hardware_concurrency();
+    if(const char* env = getenv("KALANG_THREADS"))
+    {
+      threads = atoi(env);
+    }
+    return std::max(threads, 1u) - 1;
+  }());
+  return instance;
+}
+
+} // namespace
+
+extern "C" int32_t kalang_parfor(int32_t start, int32_t limit, int32_t step,
+  KalangParforChunk chunk, void* env, int32_t reduction)
+{
+  if(step <= 0 || start >= limit)
+  {
+    return identity(reduction);
+  }
+  int64_t trips = ((int64_t)limit - start + step - 1) / step;
+
+  Job job;
+  job.chunk = chunk;
+  job.env = env;
+  job.start = start;
+  job.limit = limit;
+  job.step = step;
+  job.reduction = reduction;
+  // a few tasks per thread, so that threads that finish early can steal
+  job.grain = std::max<int64_t>(1, trips / (pool().size() * 8));
+  job.remaining = trips;
+  job.result = identity(reduction);
+
+  pool().runJob(job, trips);
+  return reduction == KALANG_REDUCE_NONE ? 0 : job.result;
+}
@@ -9,18 +9,34 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <iostream>
+#include <chrono>
 #include <cmath>
 #include <sstream>
 #include <fstream>
 
 #include "runtime.hpp"
+#include "options.hpp"
+
+// a script the JIT refuses, e.g. one defining a function twice, gets an error
+// in its output, the process keeps running for the next request or file
+static bool failed(llvm::Error Err)
+{
+  if(!Err)
+  {
+    return false;
+  }
+  llvm::logAllUnhandledErrors(std::move(Err), runErrs(), "Error: ");
+  return true;
+}
 
 Parser::Parser()
   : m_eofReached(0), m_nextToken(tok_start), m_nextChar(' '),
-  m_curr_idx(0), m_curr_token(tok_start)
+  m_curr_idx(0), m_curr_token(tok_start), m_anonCount(0), m_wholeProgram(false),
+  m_inlineImports(false), m_emitOnly(false)
 {
   //Define ':' for sequencing: as a low-precedence operator that ignores operands
   // m_binopPrecedence[tok_colon] = 1;
@@ -35,14 +51,14 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype()
 {
   if(m_curr_token != tok_identifier)
   {
-    printf("Error: Expected function name in prototype\n");
+    fprintf(TheOut, "Error: Expected function name in prototype\n");
     return nullptr;
   }
   std::string functionName = m_identifierStr;
   advanceToken(); // consume function name
   if(m_curr_token != tok_open_paren)
   {
-    printf("Error: Expected ( after function name in prototype\n");
+    fprintf(TheOut, "Error: Expected ( after function name in prototype\n");
     return nullptr;
   }
   advanceToken(); // consume (
@@ -58,7 +74,7 @@ std::unique_ptr<PrototypeAST> Parser::parsePrototype()
   }
   if(m_curr_token != tok_close_paren)
   {
-    printf("Error: Expected ) after function name in prototype\n");
+    fprintf(TheOut, "Error: Expected ) after function name in prototype\n");
     return nullptr;
   }
   advanceToken(); // consume )
@@ -70,7 +86,7 @@ int Parser::getTokPrec()
 {
   if(!isascii(m_curr_token))
   {
-    printf("Could not accept non ascii operator\n");
+    fprintf(TheOut, "Could not accept non ascii operator\n");
     return -1;
   }
   int prec = m_binopPrecedence[m_curr_token];
@@ -81,24 +97,6 @@ int Parser::getTokPrec()
   return prec;
 }
 
-std::unique_ptr<ExprAST> Parser::parseParenExpr()
-{
-  advanceToken(); // consume (
-  auto expr = parseExpression();
-  if(nullptr == expr)
-  {
-    return nullptr;
-  }
-
-  if(m_curr_token != tok_close_paren)
-  {
-    printf("Error: Expected )\n");
-    return nullptr;
-  }
-  advanceToken(); // consume )
-  return std::move(expr);
-}
-
 // identifierExpr := identifier | identifier '(' expression* ')'
 std::unique_ptr<ExprAST> Parser::parseIdentifierExpr()
 {
@@ -132,7 +130,7 @@ std::unique_ptr<ExprAST> Parser::parseIdentifierExpr()
       }
       if(m_curr_token != tok_comma)
       {
-        printf("Error: Expected after comma after argument\n");
+        fprintf(TheOut, "Error: Expected after comma after argument\n");
         return nullptr;
       }
       advanceToken(); // eat ,
@@ -157,7 +155,7 @@ std::unique_ptr<ExprAST> Parser::parseIfExpr()
 
   if(m_curr_token != tok_then)
   {
-    printf("Error: Expected then after if condition\n");
+    fprintf(TheOut, "Error: Expected then after if condition\n");
     return nullptr;
   }
   advanceToken(); // eat then
@@ -165,7 +163,7 @@ std::unique_ptr<ExprAST> Parser::parseIfExpr()
   auto then = parseExpression();
   if(m_curr_token != tok_else)
   {
-    printf("Error: Expected else\n");
+    fprintf(TheOut, "Error: Expected else\n");
     return nullptr;
   }
   advanceToken(); // eat else
@@ -177,13 +175,16 @@ std::unique_ptr<ExprAST> Parser::parseIfExpr()
   return std::make_unique<IfExprAST>(std::move(cond), std::move(then), std::move(else_)); 
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
+/// forexpr ::= 'for' identifier '=' expr ';' expr (';' expr)? 'then' expression
+/// parforexpr ::= 'parfor' identifier '=' expr ';' identifier '<' expr (';' expr)?
+///                ('reduce' ('+' | '*'))? 'then' expression
 std::unique_ptr<ExprAST> Parser::parseForExpr()
 {
+  bool parallel = m_curr_token == tok_parfor;
   advanceToken(); // eat for
   if(m_curr_token != tok_identifier)
   {
-    printf("Error: Expected identifier\n");
+    fprintf(TheOut, "Error: Expected identifier\n");
     return nullptr;
   }
 
@@ -192,7 +193,7 @@ std::unique_ptr<ExprAST> Parser::parseForExpr()
   
   if(m_curr_token != tok_assignment)
   {
-    printf("Error: Expected '=' operator\n");
+    fprintf(TheOut, "Error: Expected '=' operator\n");
     return nullptr;
   }
   advanceToken(); // eat =
@@ -205,11 +206,29 @@ std::unique_ptr<ExprAST> Parser::parseForExpr()
 
   if(m_curr_token != tok_semicolon)
   {
-    printf("Error: Expected semi colon\n");
+    fprintf(TheOut, "Error: Expected semi colon\n");
     return nullptr;
   }
   advanceToken(); // eat ;
 
+  // the iterations of a parfor are split up front, so its end must be a
+  // bound on the loop variable
+  if(parallel)
+  {
+    if(m_curr_token != tok_identifier || m_identifierStr != idName)
+    {
+      fprintf(TheOut, "Error: Expected %s < limit in parfor\n", idName.c_str());
+      return nullptr;
+    }
+    advanceToken(); // eat identifier
+    if(m_curr_token != tok_less)
+    {
+      fprintf(TheOut, "Error: Expected %s < limit in parfor\n", idName.c_str());
+      return nullptr;
+    }
+    advanceToken(); // eat <
+  }
+
   auto end = parseExpression();
   if(!end)
   {
@@ -227,9 +246,23 @@ std::unique_ptr<ExprAST> Parser::parseForExpr()
     }
   }
 
+  // reduce is only a keyword here, elsewhere it is a plain name
+  Token reduction = tok_start;
+  if(parallel && m_curr_token == tok_identifier && m_identifierStr == "reduce")
+  {
+    advanceToken(); // eat reduce
+    if(m_curr_token != tok_plus && m_curr_token != tok_mult)
+    {
+      fprintf(TheOut, "Error: Expected + or * after reduce\n");
+      return nullptr;
+    }
+    reduction = m_curr_token;
+    advanceToken(); // eat operator
+  }
+
   if(m_curr_token != tok_then)
   {
-    printf("Error: Expected then\n");
+    fprintf(TheOut, "Error: Expected then\n");
     return nullptr;
   }
   advanceToken(); // eat then
@@ -239,6 +272,12 @@ std::unique_ptr<ExprAST> Parser::parseForExpr()
   {
     return nullptr;
   }
+  if(parallel)
+  {
+    return std::make_unique<ParForExprAST>(
+      idName, std::move(start), std::move(end), std::move(step), std::move(body), reduction
+    );
+  }
   return std::make_unique<ForExprAST>(
     idName, std::move(start), std::move(end), std::move(step), std::move(body)
   );
@@ -254,7 +293,7 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr()
 
   if(m_curr_token != tok_identifier)
   {
-    printf("Error: Expected identifier after var\n");
+    fprintf(TheOut, "Error: Expected identifier after var\n");
     return nullptr;
   }
   while(1)
@@ -283,14 +322,14 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr()
     
     if(m_curr_token != tok_identifier)
     {
-      printf("Error: Expected identifier list after var");
+      fprintf(TheOut, "Error: Expected identifier list after var");
       return nullptr;
     }
   }
 
   if(m_curr_token != tok_in)
   {
-    printf("Error: Expected in after var\n");
+    fprintf(TheOut, "Error: Expected in after var\n");
     return nullptr;
   }
   advanceToken(); // eat in
@@ -303,7 +342,7 @@ std::unique_ptr<ExprAST> Parser::parseVarExpr()
 
   if(m_curr_token != tok_colon)
   {
-    printf("Error: Expected colon\n");
+    fprintf(TheOut, "Error: Expected colon\n");
     return nullptr;
   }
   advanceToken(); // eat :
@@ -320,11 +359,10 @@ std::unique_ptr<ExprAST> Parser::parsePrimary()
       return parseIdentifierExpr();
     case tok_number:
       return parseNumberExpr();
-    case tok_open_paren:
-      return parseParenExpr();
     case tok_if:
       return parseIfExpr();
     case tok_for:
+    case tok_parfor:
       return parseForExpr();
     case tok_var:
       return parseVarExpr();
@@ -333,51 +371,83 @@ std::unique_ptr<ExprAST> Parser::parsePrimary()
   }
 }
 
-std::unique_ptr<ExprAST> Parser::parseBinOpRHS(int exprPrec, std::unique_ptr<ExprAST> lhs)
+/// expression ::= ('(')* primary (')')* (binop ('(')* primary (')')*)*
+// Operators and parentheses wait on explicit stacks until their operands are
+// parsed, so long chains of operators and deeply nested parentheses take no
+// native stack. Operators of equal precedence group to the left.
+std::unique_ptr<ExprAST> Parser::parseExpression()
 {
+  std::vector<std::unique_ptr<ExprAST>> operands;
+  // binary operators, and tok_open_paren for each parenthesis not closed yet
+  std::vector<Token> operators;
+  size_t openParens = 0;
+
+  auto reduce = [&]() {
+    auto rhs = std::move(operands.back());
+    operands.pop_back();
+    auto lhs = std::move(operands.back());
+    operands.pop_back();
+    operands.push_back(std::make_unique<BinaryExprAST>(std::move(lhs), operators.back(), std::move(rhs)));
+    operators.pop_back();
+  };
+
   while(true)
   {
-    int currPrec = getTokPrec();
-    if(currPrec < exprPrec )
+    while(m_curr_token == tok_open_paren)
     {
-      return lhs;
+      operators.push_back(tok_open_paren);
+      ++openParens;
+      advanceToken(); // consume (
     }
-
-    Token binop = m_curr_token;
-    advanceToken(); // eat operator
-
-    auto rhs = parsePrimary();
-    if(nullptr == rhs)
+    auto operand = parsePrimary();
+    if(nullptr == operand)
     {
       return nullptr;
     }
+    operands.push_back(std::move(operand));
 
-    int nextPrec = getTokPrec();
-    if(currPrec < nextPrec)
+    // a ) with no ( of this expression open ends it, e.g. in a call
+    while(m_curr_token == tok_close_paren && openParens)
     {
-      rhs = parseBinOpRHS(currPrec + 1, std::move(rhs));
-      if(nullptr == rhs)
+      while(operators.back() != tok_open_paren)
       {
-        return nullptr;
+        reduce();
       }
+      operators.pop_back();
+      --openParens;
+      advanceToken(); // consume )
+    }
+
+    int prec = getTokPrec();
+    if(prec < 0)
+    {
+      break;
+    }
+    while(!operators.empty() && operators.back() != tok_open_paren &&
+      m_binopPrecedence[operators.back()] >= prec)
+    {
+      reduce();
     }
-    lhs = std::make_unique<BinaryExprAST>(std::move(lhs), binop, std::move(rhs));
+    operators.push_back(m_curr_token);
+    advanceToken(); // eat operator
   }
-}
 
-std::unique_ptr<ExprAST> Parser::parseExpression()
-{
-  auto lhs = parsePrimary();
-  if(nullptr == lhs)
+  if(openParens)
   {
+    fprintf(TheOut, "Error: Expected )\n");
     return nullptr;
   }
-  return parseBinOpRHS(0, std::move(lhs));
+  while(!operators.empty())
+  {
+    reduce();
+  }
+  return std::move(operands.back());
 }
 
 void Parser::read_line()
 {
   getline(std::cin, m_source);
+  m_classes.classify(m_source.data(), m_source.size());
 }
 
 std::string Parser::get_source()
@@ -387,27 +457,18 @@ std::string Parser::get_source()
 
 void Parser::skip_whitespace()
 {
-  while(isspace(m_source[m_curr_idx]))
-  {
-    m_curr_idx++;
-  }
+  m_curr_idx = m_classes.skipSpaces(m_curr_idx);
 }
 
 int Parser::scan_int()
 {
-  char curr_char = m_source[m_curr_idx];
+  size_t end = m_classes.skipDigits(m_curr_idx);
   int result = 0;
-  while(isdigit(curr_char))
+  for(; (size_t)m_curr_idx < end; ++m_curr_idx)
   {
-    result = result * 10 + curr_char - '0';
-    m_curr_idx++;
-    if(m_curr_idx >= m_source.length() || isspace(m_source[m_curr_idx]))
-    {
-      break;
-    }
-    curr_char = m_source[m_curr_idx];
+    result = result * 10 + m_source[m_curr_idx] - '0';
   }
-  return result;;
+  return result;
 }
 
 // entry point
@@ -420,14 +481,43 @@ void Parser::parse()
     {
       if(auto fAst = parseDefinition())
       {
-        if(auto* fIR = fAst->codegen())
+        if(m_wholeProgram)
+        {
+          // printed once optimized together with the rest of the file
+          fAst->codegen();
+        }
+        else if(m_emitOnly)
         {
-          fIR->print(llvm::errs());
-          printf("\n");
-          ExitOnErr(TheJIT->addModule(
+          if(codegenDefinition(*fAst))
+          {
+            recordDefinition(*TheModule);
+            InitializeModule();
+          }
+        }
+        else if(getJIT().isRedefinable())
+        {
+          defineRedefinable(*fAst);
+        }
+        else if(getJIT().isLazy())
+        {
+          defineLazy(*fAst);
+        }
+        else if(auto* fIR = codegenDefinition(*fAst))
+        {
+          std::string name = fIR->getName().str();
+          recordDefinition(*TheModule);
+          bool added = !failed(getJIT().addModule(
             llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
           ));
           InitializeModule();
+          if(added)
+          {
+            // compile ahead of the first call, in the background when there
+            // are compile threads. Doing it now also keeps callees compiled
+            // before their callers, so a lookup never has to materialize a
+            // whole call chain recursively.
+            getJIT().prefetch(name);
+          }
         }
       }
       else
@@ -442,7 +532,7 @@ void Parser::parse()
       {
         if(auto* fIR = protoAst->codegen())
         {
-          printf("\n");
+          fprintf(TheOut, "\n");
           FunctionProtos[protoAst->getName()] = std::move(protoAst);
         }
       }
@@ -459,21 +549,39 @@ void Parser::parse()
     {
       if(auto fAst = parseTopLevel())
       {
-        if(auto* fIR = fAst->codegen())
+        if(m_wholeProgram)
         {
-          auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+          if(auto* fIR = fAst->codegen())
+          {
+            FunctionProtos.erase(fIR->getName().str());
+            m_programExprs.push_back(fIR->getName().str());
+          }
+        }
+        else if(m_emitOnly)
+        {
+          // nothing runs them, and dump.ll never has them
+          if(auto* fIR = fAst->codegen())
+          {
+            FunctionProtos.erase(fIR->getName().str());
+            InitializeModule();
+          }
+        }
+        else if(auto* fIR = fAst->codegen())
+        {
+          if(m_inlineImports)
+          {
+            importForInlining(*TheModule);
+          }
+          std::string name = fIR->getName().str();
+          FunctionProtos.erase(name);
+          auto RT = getJIT().getCurrentJITDylib().createResourceTracker();
           auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-          ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+          bool added = !failed(getJIT().addModule(std::move(TSM), RT));
           InitializeModule();
-          auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-          assert(ExprSymbol && "Function not found");
-
-          // Get the symbol's address and cast it to the right type (takes no
-          // arguments, returns an int) so we can call it as a native function.
-          int (*FP)() = (int (*)())(intptr_t)ExprSymbol.getAddress();
-          fprintf(stderr, "Evaluated to %d\n", FP());
-          ExitOnErr(RT->remove());
-
+          if(added)
+          {
+            m_pending.push_back({name, RT, getJIT().lookupAsync(name)});
+          }
         }
       }
       else
@@ -481,7 +589,352 @@ void Parser::parse()
         advanceToken();
       }
     }
+    runPendingExprs(false);
   }
+  if(m_wholeProgram)
+  {
+    finishWholeProgram();
+  }
+  runPendingExprs(true);
+}
+
+// optimize the module holding the whole file, hand it to the JIT and queue
+// its top level expressions
+void Parser::finishWholeProgram()
+{
+  optimizeWholeProgram(*TheModule, m_programExprs);
+  TheModule->print(runErrs(), nullptr);
+  recordDefinition(*TheModule);
+  // the expressions only exist to be run by the JIT
+  for(auto& name : m_programExprs)
+  {
+    if(auto* F = TheProgram ? TheProgram->getFunction(name) : nullptr)
+    {
+      F->eraseFromParent();
+    }
+  }
+  if(m_emitOnly)
+  {
+    m_programExprs.clear();
+    InitializeModule();
+    return;
+  }
+
+  bool added = !failed(getJIT().addModule(
+    llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
+  ));
+  InitializeModule();
+  if(!added)
+  {
+    m_programExprs.clear();
+    return;
+  }
+  for(auto& name : m_programExprs)
+  {
+    m_pending.push_back({name, nullptr, getJIT().lookupAsync(name)});
+  }
+  m_programExprs.clear();
+}
+
+// generate a definition and print its IR. With inline imports, the small
+// functions defined before are inlined into it, and it is kept for the ones
+// defined after.
+llvm::Function* Parser::codegenDefinition(FuncAST& fAst)
+{
+  auto* fIR = fAst.codegen();
+  if(!fIR)
+  {
+    return nullptr;
+  }
+  if(m_inlineImports)
+  {
+    importForInlining(*TheModule);
+    rememberForInlining(*fIR);
+  }
+  fIR->print(runErrs());
+  fprintf(TheOut, "\n");
+  return fIR;
+}
+
+// compile a definition behind a stub, replacing any earlier body of the same
+// function without touching its callers
+void Parser::defineRedefinable(FuncAST& fAst)
+{
+  const PrototypeAST& proto = fAst.getProto();
+  std::string name = proto.getName();
+  if(getJIT().isDefined(name))
+  {
+    auto old = FunctionProtos.find(name);
+    if(old != FunctionProtos.end() && old->second->getNumArgs() != proto.getNumArgs())
+    {
+      fprintf(TheOut, "Error: %s takes %zu arguments, it cannot be redefined with %zu\n",
+        name.c_str(), old->second->getNumArgs(), proto.getNumArgs());
+      return;
+    }
+    // expressions read before this definition still get the old body
+    runPendingExprs(true);
+  }
+
+  auto* fIR = codegenDefinition(fAst);
+  if(!fIR)
+  {
+    return;
+  }
+
+  // calls to name from inside the body stay direct calls to this body
+  std::string implName = getJIT().newImplName(name);
+  fIR->setName(implName);
+  auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+  InitializeModule();
+  failed(getJIT().defineFunction(name, implName, std::move(TSM)));
+}
+
+// compile a definition on its first call, the body gets its own name and
+// callers go through a stub
+void Parser::defineLazy(FuncAST& fAst)
+{
+  auto* fIR = codegenDefinition(fAst);
+  if(!fIR)
+  {
+    return;
+  }
+  recordDefinition(*TheModule);
+
+  std::string name = fIR->getName().str();
+  std::string implName = getJIT().newImplName(name);
+  fIR->setName(implName);
+  auto TSM = llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+  InitializeModule();
+  failed(getJIT().addLazyFunction(name, implName, std::move(TSM), fAst.getCallees()));
+}
+
+// execute queued top level expressions in source order, without wait only the
+// ones whose code is already compiled are run
+void Parser::runPendingExprs(bool wait)
+{
+  while(!m_pending.empty())
+  {
+    auto& expr = m_pending.front();
+    if(!wait && expr.symbol.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      break;
+    }
+    // ready means the expression and everything it calls are emitted,
+    // definitions still compiling for later expressions do not hold it up
+    auto ExprSymbol = expr.symbol.get();
+    if(!ExprSymbol)
+    {
+      // e.g. a call to a function that was declared but never defined
+      std::string error = llvm::toString(ExprSymbol.takeError());
+      if(TheExecutors)
+      {
+        // printed in turn with the results of the executors
+        std::promise<RemoteResult> failed;
+        failed.set_value({false, 0, error});
+        m_remote.push_back(failed.get_future().share());
+      }
+      else
+      {
+        fprintf(TheOut, "Error: %s\n", error.c_str());
+      }
+      if(expr.tracker)
+      {
+        failed(getJIT().removeModule(expr.tracker));
+      }
+      m_pending.pop_front();
+      continue;
+    }
+    if(TheExecutors)
+    {
+      // compiled and linked here, run elsewhere
+      m_remote.push_back(TheExecutors->run(expr.name));
+      if(expr.tracker)
+      {
+        failed(getJIT().removeModule(expr.tracker));
+      }
+      m_pending.pop_front();
+      continue;
+    }
+
+    // Get the symbol's address and cast it to the right type (takes no
+    // arguments, returns an int) so we can call it as a native function.
+    int (*FP)() = (int (*)())(intptr_t)ExprSymbol->getAddress();
+    fprintf(TheErr, "Evaluated to %d\n", FP());
+    if(expr.tracker)
+    {
+      failed(getJIT().removeModule(expr.tracker));
+    }
+    m_pending.pop_front();
+  }
+  printRemoteResults(wait);
+}
+
+// print what the executors gave for their expressions in source order, without
+// wait only as far as they are finished
+void Parser::printRemoteResults(bool wait)
+{
+  while(!m_remote.empty())
+  {
+    auto& result = m_remote.front();
+    if(!wait && result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    {
+      return;
+    }
+    const RemoteResult& done = result.get();
+    if(done.ok)
+    {
+      fprintf(TheErr, "Evaluated to %d\n", done.value);
+    }
+    else
+    {
+      fprintf(TheOut, "Error: %s\n", done.error.c_str());
+    }
+    m_remote.pop_front();
+  }
+}
+
+// a duration in the unit that keeps it readable
+static std::string formatDuration(double seconds)
+{
+  char buf[32];
+  if(seconds < 1e-6)
+  {
+    snprintf(buf, sizeof(buf), "%.0f ns", seconds * 1e9);
+  }
+  else if(seconds < 1e-3)
+  {
+    snprintf(buf, sizeof(buf), "%.2f us", seconds * 1e6);
+  }
+  else if(seconds < 1)
+  {
+    snprintf(buf, sizeof(buf), "%.2f ms", seconds * 1e3);
+  }
+  else
+  {
+    snprintf(buf, sizeof(buf), "%.2f s", seconds);
+  }
+  return buf;
+}
+
+// The REPL's `:time expr` and `:bench expr [calls]`, with expr in m_source.
+// The expression is compiled like any other, but as a call even when its
+// arguments are constant, since folding it would leave nothing to run.
+void Parser::measure(bool bench)
+{
+  using Clock = std::chrono::steady_clock;
+  auto elapsed = [](Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double>(to - from).count();
+  };
+  // starting the JIT and compiling earlier definitions are not measured
+  getJIT().waitForPrefetches();
+
+  auto start = Clock::now();
+  m_curr_token = advanceToken();
+  auto fAst = parseTopLevel();
+  int calls = 1000;
+  while(m_curr_token == tok_semicolon)
+  {
+    advanceToken();
+  }
+  if(fAst && bench && m_curr_token == tok_number)
+  {
+    calls = m_numVal;
+    advanceToken();
+  }
+  while(m_curr_token == tok_semicolon)
+  {
+    advanceToken();
+  }
+  if(!fAst || m_curr_token != tok_eof || calls < 1)
+  {
+    fprintf(TheOut, "Error: usage is %s\n", bench ? ":bench expr [calls]" : ":time expr");
+    return;
+  }
+  auto parsed = Clock::now();
+
+  unsigned fuel = TheOptions.constEvalFuel;
+  TheOptions.constEvalFuel = 0;
+  auto* fIR = fAst->codegen();
+  TheOptions.constEvalFuel = fuel;
+  if(!fIR)
+  {
+    return;
+  }
+  if(m_inlineImports)
+  {
+    importForInlining(*TheModule);
+  }
+  std::string name = fIR->getName().str();
+  FunctionProtos.erase(name);
+  auto RT = getJIT().getCurrentJITDylib().createResourceTracker();
+  bool added = !failed(getJIT().addModule(
+    llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)), RT
+  ));
+  InitializeModule();
+  if(!added)
+  {
+    return;
+  }
+  auto generated = Clock::now();
+
+  auto ExprSymbol = getJIT().lookupAsync(name).get();
+  getJIT().waitForPrefetches();
+  auto compiled = Clock::now();
+  if(!ExprSymbol)
+  {
+    fprintf(TheOut, "Error: %s\n", llvm::toString(ExprSymbol.takeError()).c_str());
+    failed(getJIT().removeModule(RT));
+    return;
+  }
+  int (*FP)() = (int (*)())(intptr_t)ExprSymbol->getAddress();
+
+  if(!bench)
+  {
+    int result = FP();
+    auto executed = Clock::now();
+    fprintf(TheErr, "Evaluated to %d\n", result);
+    fprintf(TheErr, "parse %s, codegen %s, compile %s, execute %s\n",
+      formatDuration(elapsed(start, parsed)).c_str(),
+      formatDuration(elapsed(parsed, generated)).c_str(),
+      formatDuration(elapsed(generated, compiled)).c_str(),
+      formatDuration(elapsed(compiled, executed)).c_str());
+  }
+  else
+  {
+    // the warmup brings the code and whatever it touches into the caches
+    int warmup = std::max(1, calls / 10);
+    int result = 0;
+    for(int i = 0; i < warmup; ++i)
+    {
+      result = FP();
+    }
+    // each call is timed on its own, so the clock's overhead is in every
+    // sample, which only matters for calls of well under a microsecond
+    std::vector<double> samples(calls);
+    auto first = Clock::now();
+    for(int i = 0; i < calls; ++i)
+    {
+      auto before = Clock::now();
+      FP();
+      samples[i] = elapsed(before, Clock::now());
+    }
+    double total = elapsed(first, Clock::now());
+    std::sort(samples.begin(), samples.end());
+    fprintf(TheErr, "Evaluated to %d\n", result);
+    fprintf(TheErr, "%d calls after %d warmup: min %s, median %s, p99 %s, %.0f calls/s\n",
+      calls, warmup,
+      formatDuration(samples.front()).c_str(),
+      formatDuration(samples[calls / 2]).c_str(),
+      formatDuration(samples[std::min(calls - 1, (int)(calls * 99LL / 100))]).c_str(),
+      calls / total);
+  }
+  failed(getJIT().removeModule(RT));
+}
+
+void Parser::read_source(std::string source)
+{
+  m_source = std::move(source);
+  m_classes.classify(m_source.data(), m_source.size());
 }
 
 void Parser::read_file(const char* fileName)
@@ -493,6 +946,7 @@ void Parser::read_file(const char* fileName)
     std::stringstream ss;
     ss << sourceFile.rdbuf();
     m_source = ss.str();
+    m_classes.classify(m_source.data(), m_source.size());
   }
 }
 
@@ -510,7 +964,6 @@ Token Parser::advanceToken()
     return tok_eof;
   }
   char curr_char;
-  std::string identifier;
 
   skip_whitespace();
   curr_char = m_source[m_curr_idx];
@@ -523,11 +976,9 @@ Token Parser::advanceToken()
   }
   else if(isalpha(curr_char))
   {
-    do{
-      curr_char = m_source[m_curr_idx];
-      identifier += curr_char;
-      ++m_curr_idx;
-    } while( m_curr_idx < m_source.length() && isalnum(m_source[m_curr_idx]));
+    size_t end = m_classes.skipAlnums(m_curr_idx + 1);
+    std::string_view identifier(m_source.data() + m_curr_idx, end - m_curr_idx);
+    m_curr_idx = end;
     if(identifier == "fungsi")
     {
       m_curr_token = tok_def;
@@ -552,6 +1003,10 @@ Token Parser::advanceToken()
     {
       m_curr_token = tok_for;
     }
+    else if(identifier == "parfor")
+    {
+      m_curr_token = tok_parfor;
+    }
     else if(identifier == "in")
     {
       m_curr_token = tok_in;
@@ -562,7 +1017,7 @@ Token Parser::advanceToken()
     }
     else
     {
-      m_identifierStr = identifier;
+      m_identifierStr.assign(identifier.data(), identifier.size());
       m_curr_token = tok_identifier;
     }
   }
@@ -655,8 +1110,10 @@ std::unique_ptr<FuncAST> Parser::parseTopLevel()
   auto expr = parseExpression();
   if(expr)
   {
-    // make anonymous prototype
-    auto prototype = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>());
+    // make anonymous prototype, numbered so that several expressions can be
+    // in flight in the JIT at once
+    std::string name = "__anon_expr" + std::to_string(m_anonCount++);
+    auto prototype = std::make_unique<PrototypeAST>(name, std::vector<std::string>());
     return std::make_unique<FuncAST>(std::move(prototype), std::move(expr));
   }
   return nullptr;
@@ -0,0 +1,67 @@
+#include "perfmap.hpp"
+
+#include "llvm/Object/SymbolSize.h"
+
+#include <string>
+#include <unistd.h>
+
+PerfMapListener::PerfMapListener()
+{
+  std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+  m_file = fopen(path.c_str(), "w");
+  if(!m_file)
+  {
+    printf("Error: could not open %s\n", path.c_str());
+  }
+}
+
+PerfMapListener::~PerfMapListener()
+{
+  if(m_file)
+  {
+    fclose(m_file);
+  }
+}
+
+void PerfMapListener::notifyObjectLoaded(
+  ObjectKey /*K*/, const llvm::object::ObjectFile& Obj,
+  const llvm::RuntimeDyld::LoadedObjectInfo& L)
+{
+  if(!m_file)
+  {
+    return;
+  }
+  // the debug copy of the object has its sections relocated to where they
+  // were loaded, so symbol addresses are final
+  llvm::object::OwningBinary<llvm::object::ObjectFile> debugObj = L.getObjectForDebug(Obj);
+  const llvm::object::ObjectFile* loaded = debugObj.getBinary();
+  if(!loaded)
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for(const auto& symAndSize : llvm::object::computeSymbolSizes(*loaded))
+  {
+    const llvm::object::SymbolRef& sym = symAndSize.first;
+    auto type = sym.getType();
+    if(!type || *type != llvm::object::SymbolRef::ST_Function)
+    {
+      llvm::consumeError(type.takeError());
+      continue;
+    }
+    auto name = sym.getName();
+    auto addr = sym.getAddress();
+    if(!name || !addr)
+    {
+      llvm::consumeError(name.takeError());
+      llvm::consumeError(addr.takeError());
+      continue;
+    }
+    fprintf(m_file, "%llx %llx %s\n",
+      (unsigned long long)*addr, (unsigned long long)symAndSize.second,
+      name->str().c_str());
+  }
+  // perf may read the map while we are still running
+  fflush(m_file);
+}
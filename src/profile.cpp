@@ -0,0 +1,223 @@
+#include "profile.hpp"
+#include "runtime.hpp"
+
+#include "llvm/IR/MDBuilder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+Profile TheProfile;
+thread_local std::string Profile::t_function;
+thread_local unsigned Profile::t_nextSite = 0;
+
+// expression wrappers are regenerated with fresh names, counting them is noise
+static bool isAnonymous(const std::string& name)
+{
+  return name.compare(0, 11, "__anon_expr") == 0;
+}
+
+uint64_t* Profile::allocCounters(unsigned n)
+{
+  for(unsigned i = 0; i < n; ++i)
+  {
+    m_storage.push_back(0);
+  }
+  return &m_storage[m_storage.size() - n];
+}
+
+void Profile::emitIncrement(uint64_t* counter)
+{
+  auto* i64 = llvm::Type::getInt64Ty(*TheContext);
+  auto* addr = llvm::ConstantExpr::getIntToPtr(
+    llvm::ConstantInt::get(i64, reinterpret_cast<uintptr_t>(counter)),
+    i64->getPointerTo()
+  );
+  auto* count = Builder->CreateLoad(i64, addr, "prof");
+  Builder->CreateStore(Builder->CreateAdd(count, llvm::ConstantInt::get(i64, 1)), addr);
+}
+
+const Profile::FunctionCounts* Profile::currentCounts() const
+{
+  auto it = m_counts.find(t_function);
+  return it == m_counts.end() ? nullptr : &it->second;
+}
+
+void Profile::beginFunction(llvm::Function* F)
+{
+  t_function = F->getName().str();
+  t_nextSite = 0;
+}
+
+void Profile::instrumentEntry()
+{
+  if(!m_instrument || isAnonymous(t_function))
+  {
+    return;
+  }
+  auto& counters = m_counters[t_function];
+  if(!counters.entry)
+  {
+    counters.entry = allocCounters(1);
+  }
+  emitIncrement(counters.entry);
+}
+
+void Profile::instrumentBranch(unsigned site, unsigned counter)
+{
+  if(!m_instrument || isAnonymous(t_function))
+  {
+    return;
+  }
+  auto& counters = m_counters[t_function];
+  while(counters.branches.size() <= site)
+  {
+    counters.branches.push_back(allocCounters(2));
+  }
+  emitIncrement(counters.branches[site] + counter);
+}
+
+void Profile::instrumentCall(const std::string& callee)
+{
+  if(!m_instrument || isAnonymous(t_function))
+  {
+    return;
+  }
+  auto& counter = m_counters[t_function].calls[callee];
+  if(!counter)
+  {
+    counter = allocCounters(1);
+  }
+  emitIncrement(counter);
+}
+
+void Profile::annotateEntry(llvm::Function* F)
+{
+  if(!m_annotate)
+  {
+    return;
+  }
+  if(auto* counts = currentCounts())
+  {
+    F->setEntryCount(counts->entry);
+  }
+}
+
+// branch weights are 32 bit, keep the ratio when the counts do not fit
+static void setWeights(llvm::BranchInst* br, uint64_t first, uint64_t second)
+{
+  uint64_t largest = std::max(first, second);
+  uint64_t scale = largest / std::numeric_limits<uint32_t>::max() + 1;
+  llvm::MDBuilder MDB(br->getContext());
+  br->setMetadata(
+    llvm::LLVMContext::MD_prof,
+    MDB.createBranchWeights(first / scale, second / scale)
+  );
+}
+
+void Profile::annotateBranch(llvm::BranchInst* br, unsigned site)
+{
+  if(!m_annotate)
+  {
+    return;
+  }
+  auto* counts = currentCounts();
+  if(counts && site < counts->branches.size())
+  {
+    setWeights(br, counts->branches[site].first, counts->branches[site].second);
+  }
+}
+
+void Profile::annotateLoop(llvm::BranchInst* guard, llvm::BranchInst* latch, unsigned site)
+{
+  if(!m_annotate)
+  {
+    return;
+  }
+  auto* counts = currentCounts();
+  if(counts && site + 1 < counts->branches.size())
+  {
+    uint64_t entries = counts->branches[site].first;
+    uint64_t runs = counts->branches[site].second;
+    uint64_t iterations = counts->branches[site + 1].first;
+    setWeights(guard, entries, runs > entries ? runs - entries : 0);
+    setWeights(latch, iterations > entries ? iterations - entries : 0, entries);
+  }
+}
+
+// text format, one record per line:
+//   fungsi <name> <entry count>
+//   branch <name> <site> <first count> <second count>
+//   call <caller> <callee> <count>
+bool Profile::save(const std::string& path) const
+{
+  std::ofstream out(path);
+  if(!out.is_open())
+  {
+    printf("Error: could not write profile %s\n", path.c_str());
+    return false;
+  }
+  for(auto& it : m_counters)
+  {
+    out << "fungsi " << it.first << " " << (it.second.entry ? *it.second.entry : 0) << "\n";
+    for(unsigned site = 0; site < it.second.branches.size(); ++site)
+    {
+      auto* counter = it.second.branches[site];
+      out << "branch " << it.first << " " << site << " " << counter[0] << " " << counter[1] << "\n";
+    }
+    for(auto& call : it.second.calls)
+    {
+      out << "call " << it.first << " " << call.first << " " << *call.second << "\n";
+    }
+  }
+  return true;
+}
+
+bool Profile::load(const std::string& path)
+{
+  std::ifstream in(path);
+  if(!in.is_open())
+  {
+    printf("Error: could not read profile %s\n", path.c_str());
+    return false;
+  }
+  std::string line;
+  while(std::getline(in, line))
+  {
+    std::istringstream record(line);
+    std::string kind, name;
+    record >> kind >> name;
+    if(kind == "fungsi")
+    {
+      record >> m_counts[name].entry;
+    }
+    else if(kind == "branch")
+    {
+      unsigned site;
+      uint64_t first, second;
+      record >> site >> first >> second;
+      auto& branches = m_counts[name].branches;
+      if(branches.size() <= site)
+      {
+        branches.resize(site + 1);
+      }
+      branches[site] = {first, second};
+    }
+    else if(kind == "call")
+    {
+      std::string callee;
+      uint64_t count;
+      record >> callee >> count;
+      m_counts[name].calls[callee] = count;
+    }
+    if(!kind.empty() && record.fail())
+    {
+      printf("Error: malformed profile record: %s\n", line.c_str());
+      return false;
+    }
+  }
+  m_annotate = true;
+  return true;
+}
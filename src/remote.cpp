@@ -0,0 +1,227 @@
+#include "remote.hpp"
+#include "options.hpp"
+#include "runtime.hpp"
+
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/EPCGenericRTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+std::unique_ptr<ExecutorPool> TheExecutors;
+
+ExecutorPool::~ExecutorPool()
+{
+  for(auto& executor : m_executors)
+  {
+    executor->queue->wait();
+    stop(*executor);
+  }
+}
+
+bool ExecutorPool::start(unsigned n)
+{
+  // kalang-executor is installed next to kalang
+  llvm::SmallString<256> path(llvm::sys::fs::getMainExecutable(nullptr, nullptr));
+  llvm::sys::path::remove_filename(path);
+  llvm::sys::path::append(path, "kalang-executor");
+  m_path = path.str().str();
+
+  for(unsigned i = 0; i < n; ++i)
+  {
+    auto executor = std::make_unique<Executor>();
+    executor->queue = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(1));
+    std::string error;
+    if(!launch(*executor, error))
+    {
+      printf("Error: cannot start %s: %s\n", m_path.c_str(), error.c_str());
+      return false;
+    }
+    m_executors.push_back(std::move(executor));
+  }
+  return true;
+}
+
+bool ExecutorPool::launch(Executor& executor, std::string& error)
+{
+  // close-on-exec, so that one executor does not hold the pipes of another
+  int toExecutor[2], fromExecutor[2];
+  if(pipe2(toExecutor, O_CLOEXEC) != 0)
+  {
+    error = strerror(errno);
+    return false;
+  }
+  if(pipe2(fromExecutor, O_CLOEXEC) != 0)
+  {
+    error = strerror(errno);
+    close(toExecutor[0]);
+    close(toExecutor[1]);
+    return false;
+  }
+
+  // the arrays of --data come after those of KALANG_DATA, as they do here.
+  // Everything the child needs is prepared before the fork, since only
+  // async-signal-safe calls are allowed after it.
+  std::string data = getenv("KALANG_DATA") ? getenv("KALANG_DATA") : "";
+  for(auto& file : TheOptions.dataFiles)
+  {
+    data += (data.empty() ? "" : ":") + file;
+  }
+  std::vector<std::string> env;
+  for(char** var = environ; *var; ++var)
+  {
+    if(strncmp(*var, "KALANG_DATA=", 12) != 0)
+    {
+      env.push_back(*var);
+    }
+  }
+  env.push_back("KALANG_DATA=" + data);
+  std::vector<char*> envp;
+  for(auto& var : env)
+  {
+    envp.push_back(&var[0]);
+  }
+  envp.push_back(nullptr);
+  std::string in = std::to_string(toExecutor[0]);
+  std::string out = std::to_string(fromExecutor[1]);
+  char* argv[] = {&m_path[0], &in[0], &out[0], nullptr};
+
+  pid_t pid = fork();
+  if(pid < 0)
+  {
+    error = strerror(errno);
+    for(int fd : {toExecutor[0], toExecutor[1], fromExecutor[0], fromExecutor[1]})
+    {
+      close(fd);
+    }
+    return false;
+  }
+  if(pid == 0)
+  {
+    // the ends the executor talks through stay open across exec
+    fcntl(toExecutor[0], F_SETFD, 0);
+    fcntl(fromExecutor[1], F_SETFD, 0);
+    execve(m_path.c_str(), argv, envp.data());
+    _exit(127);
+  }
+  close(toExecutor[0]);
+  close(fromExecutor[1]);
+
+  auto EPC = llvm::orc::SimpleRemoteEPC::Create<llvm::orc::FDSimpleRemoteEPCTransport>(
+    std::make_unique<llvm::orc::DynamicThreadPoolTaskDispatcher>(),
+    llvm::orc::SimpleRemoteEPC::Setup(), fromExecutor[0], toExecutor[1]
+  );
+  if(!EPC)
+  {
+    error = llvm::toString(EPC.takeError());
+    waitpid(pid, nullptr, 0);
+    return false;
+  }
+  executor.pid = pid;
+  executor.ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(*EPC));
+  auto& ES = *executor.ES;
+  // code and data are written into the executor's memory over the pipes
+  executor.ObjectLayer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(ES, [&ES]() {
+    return llvm::cantFail(
+      llvm::orc::EPCGenericRTDyldMemoryManager::CreateWithDefaultBootstrapSymbols(ES.getExecutorProcessControl())
+    );
+  });
+  executor.JD = &ES.createBareJITDylib("<executor>");
+  // the kalang runtime and libc, as the executor has them
+  auto search = llvm::orc::EPCDynamicLibrarySearchGenerator::GetForTargetProcess(ES);
+  if(!search)
+  {
+    error = llvm::toString(search.takeError());
+    stop(executor);
+    return false;
+  }
+  executor.JD->addGenerator(std::move(*search));
+  executor.linked = 0;
+  return true;
+}
+
+int ExecutorPool::stop(Executor& executor)
+{
+  if(executor.ES)
+  {
+    llvm::consumeError(executor.ES->endSession());
+  }
+  executor.ObjectLayer.reset();
+  executor.ES.reset();
+  executor.JD = nullptr;
+  int status = 0;
+  if(executor.pid > 0)
+  {
+    waitpid(executor.pid, &status, 0);
+    executor.pid = -1;
+  }
+  return status;
+}
+
+void ExecutorPool::addObject(const llvm::object::ObjectFile& obj)
+{
+  std::lock_guard<std::mutex> lock(m_objectsMutex);
+  m_objects.push_back(obj.getData().str());
+}
+
+RemoteResult ExecutorPool::run(Executor& executor, const std::string& name)
+{
+  RemoteResult result;
+  if(!executor.ES && !launch(executor, result.error))
+  {
+    return result;
+  }
+
+  std::vector<std::string> objects;
+  {
+    std::lock_guard<std::mutex> lock(m_objectsMutex);
+    objects.assign(m_objects.begin() + executor.linked, m_objects.end());
+  }
+  for(auto& object : objects)
+  {
+    // linked when a lookup needs them, like in the JIT
+    auto err = executor.ObjectLayer->add(*executor.JD, llvm::MemoryBuffer::getMemBufferCopy(object, "kalang"));
+    if(err)
+    {
+      result.error = llvm::toString(std::move(err));
+      return result;
+    }
+  }
+  executor.linked += objects.size();
+
+  llvm::orc::MangleAndInterner Mangle(*executor.ES, getJIT().getDataLayout());
+  auto symbol = executor.ES->lookup({executor.JD}, Mangle(name));
+  llvm::Expected<int32_t> value = symbol ?
+    executor.ES->getExecutorProcessControl().runAsMain(llvm::orc::ExecutorAddr(symbol->getAddress()), {}) :
+    llvm::Expected<int32_t>(symbol.takeError());
+  if(!value)
+  {
+    // the executor may be gone, start over with a new one next time
+    result.error = llvm::toString(value.takeError());
+    int status = stop(executor);
+    if(WIFSIGNALED(status))
+    {
+      result.error = std::string("the executor was killed by signal ") + strsignal(WTERMSIG(status));
+    }
+    return result;
+  }
+  result.ok = true;
+  result.value = *value;
+  return result;
+}
+
+std::shared_future<RemoteResult> ExecutorPool::run(const std::string& name)
+{
+  Executor& executor = *m_executors[m_next];
+  m_next = (m_next + 1) % m_executors.size();
+  return executor.queue->async([this, &executor, name]() { return run(executor, name); });
+}
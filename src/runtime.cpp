@@ -1,31 +1,73 @@
 #include "runtime.hpp"
+#include "options.hpp"
+#include "remote.hpp"
 
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Transforms/IPO/DeadArgumentElimination.h>
+#include <llvm/Transforms/IPO/ElimAvailExtern.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/Inliner.h>
+#include <llvm/Transforms/IPO/SCCP.h>
+#include <llvm/Transforms/Scalar/IndVarSimplify.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopDeletion.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/LoopRotation.h>
+#include <llvm/Transforms/Scalar/LoopUnrollPass.h>
+
+#include <algorithm>
 #include <memory>
 
-std::unique_ptr<llvm::LLVMContext> TheContext;
-std::unique_ptr<llvm::Module> TheModule;
-std::unique_ptr<llvm::IRBuilder<>> Builder;
-std::map<std::string, llvm::AllocaInst* > NamedValues;
+thread_local std::unique_ptr<llvm::LLVMContext> TheContext;
+thread_local std::unique_ptr<llvm::Module> TheModule;
+thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+thread_local ScopedSymbolTable NamedValues;
 std::shared_ptr<llvm::orc::KalangJIT> TheJIT;
-std::unique_ptr<llvm::FunctionPassManager> TheFPM;
-std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
-std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
-std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
-std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
-std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<llvm::StandardInstrumentations> TheSI;
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+thread_local std::unique_ptr<llvm::FunctionPassManager> TheFPM;
+thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+thread_local std::unordered_map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 llvm::ExitOnError ExitOnErr;
+thread_local std::unique_ptr<llvm::LLVMContext> TheProgramContext;
+thread_local std::unique_ptr<llvm::Module> TheProgram;
+thread_local FILE* TheOut = stdout;
+thread_local FILE* TheErr = stderr;
 
-void InitializeModule() {
-  // Open a new context and module.
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("Just In Time Compiler", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+namespace {
+// Writes to TheErr, whichever file that is when the write happens.
+class RunErrStream : public llvm::raw_ostream {
+  uint64_t Pos = 0;
 
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+  void write_impl(const char *Ptr, size_t Size) override {
+    fwrite(Ptr, 1, Size, TheErr);
+    Pos += Size;
+  }
+  uint64_t current_pos() const override { return Pos; }
+
+public:
+  RunErrStream() { SetUnbuffered(); }
+};
+} // namespace
 
+llvm::raw_ostream& runErrs() {
+  static thread_local RunErrStream S;
+  return S;
+}
+
+// The pass pipeline does not depend on the module, so it is built once and
+// reused for every definition.
+static void InitializePassManagers() {
   TheFPM = std::make_unique<llvm::FunctionPassManager>();
   TheLAM = std::make_unique<llvm::LoopAnalysisManager>();
   TheFAM = std::make_unique<llvm::FunctionAnalysisManager>();
@@ -37,8 +79,9 @@ void InitializeModule() {
   TheSI->registerCallbacks(*ThePIC, TheFAM.get());
 
   // Add transform passes.
-  // Promote Allocas to registers
-  TheFPM->addPass(llvm::PromotePass());
+  // Promote Allocas to registers, codegen already builds SSA with --ssa
+  if (!TheOptions.ssa)
+    TheFPM->addPass(llvm::PromotePass());
   // Do simple "peephole" optimizations and bit-twiddling optzns.
   TheFPM->addPass(llvm::InstCombinePass());
   // Reassociate expressions.
@@ -48,13 +91,277 @@ void InitializeModule() {
   // Simplify the control flow graph (deleting unreachable blocks, etc).
   TheFPM->addPass(llvm::SimplifyCFGPass());
 
+  // Loop passes. Their adaptors first put each loop in simplified and LCSSA
+  // form. Rotate loops and hoist invariant code out of them.
+  llvm::LoopPassManager LoopCanonical;
+  LoopCanonical.addPass(llvm::LoopRotatePass());
+  LoopCanonical.addPass(llvm::LICMPass());
+  TheFPM->addPass(llvm::createFunctionToLoopPassAdaptor(
+      std::move(LoopCanonical), /*UseMemorySSA=*/true));
+  // Canonicalize induction variables, replacing values used after a loop by
+  // their final value computed by SCEV, and delete loops left without effect.
+  llvm::LoopPassManager LoopIndVars;
+  LoopIndVars.addPass(llvm::IndVarSimplifyPass());
+  LoopIndVars.addPass(llvm::LoopDeletionPass());
+  TheFPM->addPass(llvm::createFunctionToLoopPassAdaptor(std::move(LoopIndVars)));
+  // Unroll loops with small constant trip counts, and clean up after it.
+  TheFPM->addPass(llvm::LoopUnrollPass());
+  TheFPM->addPass(llvm::InstCombinePass());
+  TheFPM->addPass(llvm::SimplifyCFGPass());
+
   // Register analysis passes used in these transform passes.
   llvm::PassBuilder PB;
   PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
 }
 
+// Create the JIT the first time something is compiled, so that runs which
+// only emit IR, or read an empty file, never pay for starting it.
+llvm::orc::KalangJIT& getJIT() {
+  if (TheJIT)
+    return *TheJIT;
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  TheJIT = ExitOnErr(llvm::orc::KalangJIT::Create(TheOptions.compileThreads));
+  if (TheOptions.perf)
+    TheJIT->enablePerfSupport();
+  if (TheOptions.lazy)
+    ExitOnErr(TheJIT->enableLazyCompilation(TheOptions.speculate));
+  if (TheOptions.redefine)
+    ExitOnErr(TheJIT->enableRedefinition());
+  if (TheExecutors)
+    TheJIT->setNotifyObjectLoaded([](const llvm::object::ObjectFile &Obj) {
+      TheExecutors->addObject(Obj);
+    });
+  return *TheJIT;
+}
+
+// The layout the JIT compiles for, known without creating the JIT.
+static const llvm::DataLayout& hostDataLayout() {
+  static const llvm::DataLayout DL = ExitOnErr(
+      ExitOnErr(llvm::orc::JITTargetMachineBuilder::detectHost())
+          .getDefaultDataLayoutForTarget());
+  return DL;
+}
+
+void InitializeModule() {
+  // Open a new context and module. An unused module from before must go
+  // first, its context would otherwise free it a second time.
+  TheModule.reset();
+  TheContext = std::make_unique<llvm::LLVMContext>();
+  TheModule = std::make_unique<llvm::Module>("Just In Time Compiler", *TheContext);
+  TheModule->setDataLayout(hostDataLayout());
+
+  // Create a new builder for the module.
+  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+
+  // Cached analyses point into the previous module, which the JIT may free
+  // at any time.
+  if (TheFPM) {
+    TheLAM->clear();
+    TheFAM->clear();
+    TheMAM->clear();
+  }
+}
+
+// Run the function pipeline on F, building it first if nothing was optimized
+// yet. Runs that never define a function do not pay for building it.
+void optimizeFunction(llvm::Function& F) {
+  if (!TheFPM)
+    InitializePassManagers();
+  TheFPM->run(F, *TheFAM);
+}
+
+// Collect every definition of the run into one module that can be written to
+// dump.ll and compiled ahead of time. The JIT gets the per definition modules.
+void InitializeProgram() {
+  TheProgram.reset();
+  TheProgramContext = std::make_unique<llvm::LLVMContext>();
+  TheProgram = std::make_unique<llvm::Module>("kalang", *TheProgramContext);
+  TheProgram->setTargetTriple(llvm::sys::getProcessTriple());
+  TheProgram->setDataLayout(hostDataLayout());
+}
+
+// Move the definitions of From into To, pointing its declarations at the
+// functions of To. llvm::Linker would be simpler, but it visits every function
+// already in To on each call, which makes recording a program quadratic in its
+// number of definitions.
+static void moveFunctions(llvm::Module& From, llvm::Module& To) {
+  std::vector<llvm::Function *> Functions;
+  for (auto &F : From)
+    Functions.push_back(&F);
+
+  for (auto *F : Functions) {
+    if (!F->isDeclaration())
+      continue;
+    auto Callee = To.getOrInsertFunction(F->getName(), F->getFunctionType());
+    F->replaceAllUsesWith(Callee.getCallee());
+  }
+
+  for (auto *F : Functions) {
+    if (F->isDeclaration())
+      continue;
+    auto *Existing = To.getFunction(F->getName());
+    if (Existing && !Existing->isDeclaration()) {
+      fprintf(TheOut, "Error: %s is already defined in the program module\n",
+             F->getName().str().c_str());
+      continue;
+    }
+    if (Existing && Existing->getFunctionType() != F->getFunctionType()) {
+      fprintf(TheOut, "Error: %s does not match its earlier declaration\n",
+             F->getName().str().c_str());
+      continue;
+    }
+    // Free the name so the definition keeps it inside To.
+    if (Existing)
+      Existing->setName("");
+    F->removeFromParent();
+    To.getFunctionList().push_back(F);
+    if (Existing) {
+      Existing->replaceAllUsesWith(F);
+      Existing->eraseFromParent();
+    }
+  }
+}
+
+void recordDefinition(const llvm::Module& M) {
+  if (!TheProgram)
+    return;
+
+  // Modules live in different contexts, so go through the textual IR.
+  std::string Str;
+  llvm::raw_string_ostream OS(Str);
+  OS << M;
+  OS.flush();
+
+  llvm::SMDiagnostic Err;
+  auto Copy = llvm::parseIR(llvm::MemoryBufferRef(Str, M.getName()), Err,
+                            *TheProgramContext);
+  if (!Copy) {
+    Err.print("kalang", runErrs());
+    return;
+  }
+
+  moveFunctions(*Copy, *TheProgram);
+}
+
+// Inline bottom up over the call graph, cleaning up each function after.
+static void addInliner(llvm::ModulePassManager& MPM) {
+  llvm::ModuleInlinerWrapperPass Inliner(llvm::getInlineParams());
+  llvm::FunctionPassManager Cleanup;
+  Cleanup.addPass(llvm::InstCombinePass());
+  Cleanup.addPass(llvm::GVNPass());
+  Cleanup.addPass(llvm::SimplifyCFGPass());
+  Inliner.getPM().addPass(
+      llvm::createCGSCCToFunctionPassAdaptor(std::move(Cleanup)));
+  MPM.addPass(std::move(Inliner));
+}
+
+static void runModulePasses(llvm::Module& M, llvm::ModulePassManager& MPM) {
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  llvm::PassBuilder PB;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  MPM.run(M, MAM);
+}
+
+// Everything but main and the top level expressions is only reachable from
+// inside the module, so it can be internalized and optimized across
+// definitions.
+void optimizeWholeProgram(llvm::Module& M, const std::vector<std::string>& exprs) {
+  for (auto &F : M) {
+    if (F.isDeclaration() || F.getName() == "main" ||
+        std::find(exprs.begin(), exprs.end(), F.getName()) != exprs.end())
+      continue;
+    F.setLinkage(llvm::GlobalValue::InternalLinkage);
+    F.setCallingConv(llvm::CallingConv::Fast);
+    for (auto *U : F.users())
+      if (auto *CI = llvm::dyn_cast<llvm::CallInst>(U))
+        if (CI->getCalledFunction() == &F)
+          CI->setCallingConv(llvm::CallingConv::Fast);
+  }
+
+  llvm::ModulePassManager MPM;
+  // Propagate constant arguments and return values across functions.
+  MPM.addPass(llvm::IPSCCPPass());
+  // Drop arguments that no caller needs.
+  MPM.addPass(llvm::DeadArgumentEliminationPass());
+  addInliner(MPM);
+  // Delete the functions that are no longer called.
+  MPM.addPass(llvm::GlobalDCEPass());
+  runModulePasses(M, MPM);
+}
+
+// Bodies of earlier definitions, each as the bitcode of the module it was
+// compiled in, which later modules import to inline them.
+static std::unordered_map<std::string, std::string> InlineCandidates;
+
+// Functions up to this many instructions are kept for inlining, the larger
+// limit applies when the profile says the function is hot.
+static const unsigned SmallFunctionSize = 40;
+static const unsigned HotFunctionSize = 200;
+static const uint64_t HotEntryCount = 1000;
+
+void rememberForInlining(llvm::Function& F) {
+  std::string Name = F.getName().str();
+  unsigned Limit = SmallFunctionSize;
+  auto Count = F.getEntryCount();
+  if (Count && Count->getCount() >= HotEntryCount)
+    Limit = HotFunctionSize;
+  if (F.getInstructionCount() > Limit) {
+    // A redefinition may have outgrown the limit.
+    InlineCandidates.erase(Name);
+    return;
+  }
+
+  std::string Bitcode;
+  llvm::raw_string_ostream OS(Bitcode);
+  llvm::WriteBitcodeToFile(*F.getParent(), OS);
+  OS.flush();
+  InlineCandidates[Name] = std::move(Bitcode);
+}
+
+void importForInlining(llvm::Module& M) {
+  std::vector<llvm::Function *> Wanted;
+  for (auto &F : M)
+    if (F.isDeclaration() && InlineCandidates.count(F.getName().str()))
+      Wanted.push_back(&F);
+  if (Wanted.empty())
+    return;
+
+  for (auto *F : Wanted) {
+    std::string Name = F->getName().str();
+    auto Src = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(InlineCandidates[Name], Name), M.getContext());
+    if (!Src) {
+      llvm::consumeError(Src.takeError());
+      continue;
+    }
+    // The JIT already has the real definition, the copy is only there to
+    // be inlined and is never emitted.
+    (*Src)->getFunction(Name)->setLinkage(
+        llvm::GlobalValue::AvailableExternallyLinkage);
+    moveFunctions(**Src, M);
+  }
+
+  llvm::ModulePassManager MPM;
+  addInliner(MPM);
+  // Turn the imported bodies back into declarations before the JIT sees
+  // the module, it must not think they are defined here.
+  MPM.addPass(llvm::EliminateAvailableExternallyPass());
+  MPM.addPass(llvm::GlobalDCEPass());
+  runModulePasses(M, MPM);
+}
+
 llvm::Function* getFunction(std::string Name) {
   // First, see if the function has already been added to the current module.
   if (auto *F = TheModule->getFunction(Name))
@@ -0,0 +1,241 @@
+#include "server.hpp"
+#include "consteval.hpp"
+#include "parser.hpp"
+#include "runtime.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+
+// a prototype of the prelude, and the copy FunctionProtos holds right now
+struct SharedProto
+{
+  PrototypeAST proto;
+  const PrototypeAST* live;
+};
+
+std::unordered_map<std::string, SharedProto> SharedProtos;
+std::unordered_map<std::string, ConstFunction> SharedConstFunctions;
+
+void rememberSharedProtos()
+{
+  for(auto& entry : FunctionProtos)
+  {
+    SharedProtos.emplace(entry.first, SharedProto{*entry.second, entry.second.get()});
+  }
+  SharedConstFunctions = ConstFunctions;
+}
+
+// forget what a request declared, and undo its redefinitions of prelude
+// functions, which only lived in its JITDylib
+void restoreSharedProtos()
+{
+  for(auto it = FunctionProtos.begin(); it != FunctionProtos.end();)
+  {
+    auto shared = SharedProtos.find(it->first);
+    if(shared == SharedProtos.end())
+    {
+      it = FunctionProtos.erase(it);
+      continue;
+    }
+    if(it->second.get() != shared->second.live)
+    {
+      it->second = std::make_unique<PrototypeAST>(shared->second.proto);
+      shared->second.live = it->second.get();
+    }
+    ++it;
+  }
+  for(auto& shared : SharedProtos)
+  {
+    auto& proto = FunctionProtos[shared.first];
+    if(!proto)
+    {
+      proto = std::make_unique<PrototypeAST>(shared.second.proto);
+      shared.second.live = proto.get();
+    }
+  }
+  ConstFunctions = SharedConstFunctions;
+}
+
+bool readAll(int fd, std::string& out)
+{
+  char buf[4096];
+  while(true)
+  {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if(n == 0)
+    {
+      return true;
+    }
+    if(n < 0 && errno != EINTR)
+    {
+      return false;
+    }
+    if(n > 0)
+    {
+      out.append(buf, n);
+    }
+  }
+}
+
+bool writeAll(int fd, const char* data, size_t size)
+{
+  while(size)
+  {
+    ssize_t n = write(fd, data, size);
+    if(n < 0 && errno != EINTR)
+    {
+      return false;
+    }
+    if(n > 0)
+    {
+      data += n;
+      size -= n;
+    }
+  }
+  return true;
+}
+
+std::string readBack(FILE* file)
+{
+  std::string text;
+  fflush(file);
+  rewind(file);
+  char buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), file)) > 0)
+  {
+    text.append(buf, n);
+  }
+  return text;
+}
+
+void flushOutput()
+{
+  fflush(stdout);
+  fflush(stderr);
+  llvm::outs().flush();
+  llvm::errs().flush();
+}
+
+// Run the script sent on client with stdout and stderr going to temporary
+// files, then send both back.
+void handleRequest(int client, unsigned id)
+{
+  std::string source;
+  if(!readAll(client, source))
+  {
+    return;
+  }
+  FILE* out = tmpfile();
+  FILE* err = tmpfile();
+  if(!out || !err)
+  {
+    printf("Error: could not create the output files of a request\n");
+    if(out)
+    {
+      fclose(out);
+    }
+    if(err)
+    {
+      fclose(err);
+    }
+    return;
+  }
+
+  flushOutput();
+  int savedOut = dup(STDOUT_FILENO);
+  int savedErr = dup(STDERR_FILENO);
+  dup2(fileno(out), STDOUT_FILENO);
+  dup2(fileno(err), STDERR_FILENO);
+
+  auto& JD = getJIT().beginRequest("request" + std::to_string(id));
+  {
+    Parser parser;
+    parser.read_source(std::move(source));
+    parser.parse();
+  }
+  if(auto Err = getJIT().removeRequestJITDylib(JD))
+  {
+    printf("Error: %s\n", llvm::toString(std::move(Err)).c_str());
+  }
+  restoreSharedProtos();
+  InitializeModule();
+
+  flushOutput();
+  dup2(savedOut, STDOUT_FILENO);
+  dup2(savedErr, STDERR_FILENO);
+  close(savedOut);
+  close(savedErr);
+
+  std::string outText = readBack(out);
+  std::string errText = readBack(err);
+  fclose(out);
+  fclose(err);
+  ServeReply reply = {(uint32_t)outText.size(), (uint32_t)errText.size()};
+  writeAll(client, (const char*)&reply, sizeof(reply)) &&
+    writeAll(client, outText.data(), outText.size()) &&
+    writeAll(client, errText.data(), errText.size());
+}
+
+} // namespace
+
+int serve(const char* socketPath, const char* preludePath)
+{
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if(strlen(socketPath) >= sizeof(addr.sun_path))
+  {
+    printf("Error: socket path %s is too long\n", socketPath);
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  // a socket left behind by a server that was killed
+  struct stat st;
+  if(stat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode))
+  {
+    unlink(socketPath);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0)
+  {
+    printf("Error: could not listen on %s: %s\n", socketPath, strerror(errno));
+    return 1;
+  }
+  // a client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+
+  if(preludePath)
+  {
+    Parser parser;
+    parser.read_file(preludePath);
+    parser.parse();
+  }
+  rememberSharedProtos();
+  // compile now rather than on the first request
+  getJIT();
+  printf("serving on %s\n", socketPath);
+  fflush(stdout);
+
+  for(unsigned id = 0;; ++id)
+  {
+    int client = accept(listener, nullptr, nullptr);
+    if(client < 0)
+    {
+      continue;
+    }
+    handleRequest(client, id);
+    close(client);
+  }
+}
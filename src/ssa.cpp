@@ -0,0 +1,133 @@
+#include "ssa.hpp"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+
+thread_local SSABuilder TheSSA;
+
+void SSABuilder::reset()
+{
+  m_names.clear();
+  m_defs.clear();
+  m_sealed.clear();
+  m_incomplete.clear();
+}
+
+int SSABuilder::newVariable(llvm::StringRef name)
+{
+  m_names.push_back(name.str());
+  return m_names.size() - 1;
+}
+
+llvm::Value* SSABuilder::read(int var, llvm::BasicBlock* block)
+{
+  auto def = m_defs.find({var, block});
+  if(def != m_defs.end() && def->second)
+  {
+    return def->second;
+  }
+  return readRecursive(var, block);
+}
+
+llvm::Value* SSABuilder::readRecursive(int var, llvm::BasicBlock* block)
+{
+  llvm::Value* value;
+  if(!m_sealed.count(block))
+  {
+    auto* phi = newPhi(var, block);
+    m_incomplete[block].emplace_back(var, phi);
+    value = phi;
+  }
+  else if(auto* pred = block->getSinglePredecessor())
+  {
+    value = read(var, pred);
+  }
+  else
+  {
+    // written before its operands are read, which ends the search of a
+    // loop that comes back here
+    auto* phi = newPhi(var, block);
+    write(var, block, phi);
+    value = addPhiOperands(var, phi);
+  }
+  write(var, block, value);
+  return value;
+}
+
+llvm::Value* SSABuilder::addPhiOperands(int var, llvm::PHINode* phi)
+{
+  for(auto* pred : llvm::predecessors(phi->getParent()))
+  {
+    phi->addIncoming(read(var, pred), pred);
+  }
+  return removeTrivialPhi(phi);
+}
+
+llvm::Value* SSABuilder::removeTrivialPhi(llvm::PHINode* phi)
+{
+  llvm::Value* same = nullptr;
+  for(llvm::Value* op : phi->incoming_values())
+  {
+    if(op == same || op == phi)
+    {
+      continue;
+    }
+    if(same)
+    {
+      return phi;
+    }
+    same = op;
+  }
+  if(!same)
+  {
+    // read before anything was written, the block is unreachable
+    same = llvm::UndefValue::get(phi->getType());
+  }
+
+  // the phis using this one may have become trivial too, and removing one
+  // of them may remove another, or same
+  std::vector<llvm::WeakTrackingVH> users;
+  for(auto* user : phi->users())
+  {
+    if(user != phi && llvm::isa<llvm::PHINode>(user))
+    {
+      users.emplace_back(user);
+    }
+  }
+  llvm::WeakTrackingVH result(same);
+  phi->replaceAllUsesWith(same);
+  phi->eraseFromParent();
+  for(auto& user : users)
+  {
+    if(auto* userPhi = llvm::dyn_cast_or_null<llvm::PHINode>(user))
+    {
+      removeTrivialPhi(userPhi);
+    }
+  }
+  return result;
+}
+
+llvm::PHINode* SSABuilder::newPhi(int var, llvm::BasicBlock* block)
+{
+  llvm::IRBuilder<> Tmp(block, block->getFirstInsertionPt());
+  return Tmp.CreatePHI(llvm::Type::getInt32Ty(block->getContext()), 2, m_names[var]);
+}
+
+void SSABuilder::seal(llvm::BasicBlock* block)
+{
+  // sealed first, so that reads of other variables reaching block while the
+  // phis are filled in get complete phis of their own
+  m_sealed.insert(block);
+  auto incomplete = m_incomplete.find(block);
+  if(incomplete == m_incomplete.end())
+  {
+    return;
+  }
+  auto phis = std::move(incomplete->second);
+  m_incomplete.erase(incomplete);
+  for(auto& entry : phis)
+  {
+    addPhiOperands(entry.first, entry.second);
+  }
+}
@@ -0,0 +1,311 @@
+#include "stream.hpp"
+#include "options.hpp"
+#include "runtime.hpp"
+
+#include "llvm/IR/Verifier.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+
+const char* BatchName = "__map_batch";
+// records per call of the batch loop
+const size_t BatchRecords = 4096;
+const size_t BufferSize = 1 << 20;
+// longer than any number worth reading, a token that does not fit is an error
+const size_t MaxToken = 64;
+
+typedef void (*BatchFunction)(const int32_t* in, int32_t* out, int32_t records);
+
+// void __map_batch(i32* in, i32* out, i32 n) sets out[r] to the function
+// called on the arity fields of record r, in[r * arity] onwards
+llvm::Function* codegenBatch(llvm::Function* callee, unsigned arity)
+{
+  auto* i32 = Builder->getInt32Ty();
+  auto* i64 = Builder->getInt64Ty();
+  auto* ptr = i32->getPointerTo();
+  auto* F = llvm::Function::Create(
+    llvm::FunctionType::get(Builder->getVoidTy(), {ptr, ptr, i32}, false),
+    llvm::Function::ExternalLinkage, BatchName, TheModule.get()
+  );
+  auto* in = F->getArg(0);
+  auto* out = F->getArg(1);
+  auto* records = F->getArg(2);
+
+  auto* entryBB = llvm::BasicBlock::Create(*TheContext, "entry", F);
+  auto* loopBB = llvm::BasicBlock::Create(*TheContext, "loop", F);
+  auto* afterBB = llvm::BasicBlock::Create(*TheContext, "afterloop", F);
+  Builder->SetInsertPoint(entryBB);
+  auto* count = Builder->CreateZExt(records, i64, "count");
+  Builder->CreateCondBr(Builder->CreateICmpSGT(records, Builder->getInt32(0)), loopBB, afterBB);
+
+  Builder->SetInsertPoint(loopBB);
+  auto* record = Builder->CreatePHI(i64, 2, "record");
+  record->addIncoming(Builder->getInt64(0), entryBB);
+  auto* first = Builder->CreateMul(record, Builder->getInt64(arity), "first");
+  std::vector<llvm::Value*> args;
+  for(unsigned i = 0; i < arity; ++i)
+  {
+    auto* field = Builder->CreateInBoundsGEP(i32, in, Builder->CreateAdd(first, Builder->getInt64(i)));
+    args.push_back(Builder->CreateLoad(i32, field, "field"));
+  }
+  auto* result = Builder->CreateCall(callee, args, "result");
+  Builder->CreateStore(result, Builder->CreateInBoundsGEP(i32, out, record));
+  auto* next = Builder->CreateAdd(record, Builder->getInt64(1), "next", true, true);
+  record->addIncoming(next, loopBB);
+  Builder->CreateCondBr(Builder->CreateICmpULT(next, count), loopBB, afterBB);
+
+  Builder->SetInsertPoint(afterBB);
+  Builder->CreateRetVoid();
+  return F;
+}
+
+// compile the batch loop around function, null with a message when there
+// is no such function
+BatchFunction compileBatch(const std::string& function, unsigned& arity)
+{
+  auto proto = FunctionProtos.find(function);
+  llvm::Function* callee = proto == FunctionProtos.end() ? nullptr : getFunction(function);
+  if(!callee)
+  {
+    fprintf(stderr, "Error: --map function %s is not defined\n", function.c_str());
+    return nullptr;
+  }
+  arity = callee->arg_size();
+  if(arity == 0)
+  {
+    fprintf(stderr, "Error: --map function %s takes no arguments\n", function.c_str());
+    return nullptr;
+  }
+
+  auto* F = codegenBatch(callee, arity);
+  llvm::verifyFunction(*F, &runErrs());
+  // with inline imports a small function is inlined into the loop
+  if(TheOptions.inlineImports)
+  {
+    importForInlining(*TheModule);
+  }
+  optimizeFunction(*F);
+  ExitOnErr(getJIT().addModule(
+    llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext))
+  ));
+  InitializeModule();
+  auto symbol = getJIT().lookupAsync(BatchName).get();
+  if(!symbol)
+  {
+    fprintf(stderr, "Error: %s\n", llvm::toString(symbol.takeError()).c_str());
+    return nullptr;
+  }
+  return (BatchFunction)(intptr_t)symbol->getAddress();
+}
+
+// Integers of the text on stdin, read in large blocks. A block is only
+// parsed up to where a number could be cut off, the rest waits for the next.
+class TextReader
+{
+private:
+  std::vector<char> m_buf;
+  size_t m_pos = 0, m_end = 0;
+  bool m_eof = false;
+
+  static bool isSpace(char c) { return static_cast<unsigned char>(c) <= ' '; }
+
+  // move what is left to the front and read more after it
+  void refill()
+  {
+    memmove(m_buf.data(), m_buf.data() + m_pos, m_end - m_pos);
+    m_end -= m_pos;
+    m_pos = 0;
+    while(!m_eof)
+    {
+      ssize_t got = read(STDIN_FILENO, m_buf.data() + m_end, m_buf.size() - m_end);
+      if(got < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      if(got <= 0)
+      {
+        m_eof = true;
+        break;
+      }
+      m_end += got;
+      return;
+    }
+  }
+
+public:
+  bool bad = false;
+
+  TextReader(): m_buf(BufferSize) {}
+
+  // the next integer, false at the end of the input, or with bad set when
+  // the input holds something else
+  bool next(int32_t& value)
+  {
+    while(true)
+    {
+      while(m_pos < m_end && isSpace(m_buf[m_pos]))
+      {
+        ++m_pos;
+      }
+      // the whole number is in the buffer, or all there is of it
+      if(m_end - m_pos >= MaxToken || m_eof)
+      {
+        break;
+      }
+      refill();
+    }
+    if(m_pos == m_end)
+    {
+      return false;
+    }
+
+    const char* p = m_buf.data() + m_pos;
+    const char* end = m_buf.data() + m_end;
+    bool negative = *p == '-';
+    p += negative;
+    // i32 wraps around, as kalang arithmetic does
+    uint32_t number = 0;
+    const char* digits = p;
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+      number = number * 10 + (*p - '0');
+      ++p;
+    }
+    if(p == digits || (p < end ? !isSpace(*p) : !m_eof))
+    {
+      bad = true;
+      return false;
+    }
+    m_pos = p - m_buf.data();
+    value = static_cast<int32_t>(negative ? 0u - number : number);
+    return true;
+  }
+};
+
+// results written to stdout in large blocks
+class Writer
+{
+private:
+  std::vector<char> m_buf;
+  size_t m_end = 0;
+
+public:
+  Writer(): m_buf(BufferSize) {}
+  ~Writer() { flush(); }
+
+  void flush()
+  {
+    fwrite(m_buf.data(), 1, m_end, stdout);
+    m_end = 0;
+  }
+
+  void writeLine(int32_t value)
+  {
+    if(m_buf.size() - m_end < 16)
+    {
+      flush();
+    }
+    char digits[12];
+    int n = 0;
+    uint32_t magnitude = value < 0 ? 0u - static_cast<uint32_t>(value) : value;
+    do
+    {
+      digits[n++] = '0' + magnitude % 10;
+      magnitude /= 10;
+    } while(magnitude);
+    if(value < 0)
+    {
+      m_buf[m_end++] = '-';
+    }
+    while(n)
+    {
+      m_buf[m_end++] = digits[--n];
+    }
+    m_buf[m_end++] = '\n';
+  }
+
+  void writeBinary(const int32_t* values, size_t count)
+  {
+    flush();
+    fwrite(values, sizeof(int32_t), count, stdout);
+  }
+};
+
+int mapText(BatchFunction batch, unsigned arity)
+{
+  TextReader reader;
+  Writer writer;
+  std::vector<int32_t> in(BatchRecords * arity), out(BatchRecords);
+  while(true)
+  {
+    size_t fields = 0;
+    while(fields < in.size() && reader.next(in[fields]))
+    {
+      ++fields;
+    }
+    if(reader.bad)
+    {
+      fprintf(stderr, "Error: the input holds something other than integers\n");
+      return 1;
+    }
+    if(fields % arity)
+    {
+      fprintf(stderr, "Error: the input ends inside a record\n");
+      return 1;
+    }
+    size_t records = fields / arity;
+    batch(in.data(), out.data(), records);
+    for(size_t i = 0; i < records; ++i)
+    {
+      writer.writeLine(out[i]);
+    }
+    if(fields < in.size())
+    {
+      return 0;
+    }
+  }
+}
+
+int mapBinary(BatchFunction batch, unsigned arity)
+{
+  Writer writer;
+  std::vector<int32_t> in(BatchRecords * arity), out(BatchRecords);
+  size_t recordBytes = arity * sizeof(int32_t);
+  while(true)
+  {
+    size_t bytes = fread(in.data(), 1, in.size() * sizeof(int32_t), stdin);
+    if(bytes % recordBytes)
+    {
+      fprintf(stderr, "Error: the input ends inside a record\n");
+      return 1;
+    }
+    size_t records = bytes / recordBytes;
+    batch(in.data(), out.data(), records);
+    writer.writeBinary(out.data(), records);
+    if(records < BatchRecords)
+    {
+      return 0;
+    }
+  }
+}
+
+} // namespace
+
+int runMap(const std::string& function, bool binary)
+{
+  unsigned arity;
+  BatchFunction batch = compileBatch(function, arity);
+  if(!batch)
+  {
+    return 1;
+  }
+  return binary ? mapBinary(batch, arity) : mapText(batch, arity);
+}
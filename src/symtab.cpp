@@ -0,0 +1,88 @@
+#include "symtab.hpp"
+
+#include <llvm/Support/xxhash.h>
+
+thread_local SymbolInterner TheSymbolNames;
+
+SymbolInterner::SymbolInterner(): m_slots(64, 0) {}
+
+void SymbolInterner::grow()
+{
+  std::vector<Symbol> slots(m_slots.size() * 2, 0);
+  size_t mask = slots.size() - 1;
+  for(Symbol sym = 0; sym < m_names.size(); ++sym)
+  {
+    size_t i = m_hashes[sym] & mask;
+    while(slots[i])
+    {
+      i = (i + 1) & mask;
+    }
+    slots[i] = sym + 1;
+  }
+  m_slots.swap(slots);
+}
+
+Symbol SymbolInterner::intern(llvm::StringRef name)
+{
+  uint64_t hash = llvm::xxHash64(name);
+  size_t mask = m_slots.size() - 1;
+  size_t i = hash & mask;
+  while(Symbol slot = m_slots[i])
+  {
+    Symbol sym = slot - 1;
+    if(m_hashes[sym] == hash && m_names[sym] == name)
+    {
+      return sym;
+    }
+    i = (i + 1) & mask;
+  }
+
+  Symbol sym = m_names.size();
+  m_names.push_back(name.str());
+  m_hashes.push_back(hash);
+  m_slots[i] = sym + 1;
+  // keep the load factor under 1/2
+  if(m_names.size() * 2 > m_slots.size())
+  {
+    grow();
+  }
+  return sym;
+}
+
+void ScopedSymbolTable::bind(Symbol sym, VarBinding binding)
+{
+  if(sym >= m_bindings.size())
+  {
+    m_bindings.resize(TheSymbolNames.size() > sym ? TheSymbolNames.size() : sym + 1);
+  }
+  m_undo.emplace_back(sym, m_bindings[sym]);
+  m_bindings[sym] = binding;
+}
+
+void ScopedSymbolTable::popScope()
+{
+  size_t mark = m_scopes.back();
+  m_scopes.pop_back();
+  while(m_undo.size() > mark)
+  {
+    m_bindings[m_undo.back().first] = m_undo.back().second;
+    m_undo.pop_back();
+  }
+}
+
+std::vector<std::pair<Symbol, VarBinding>> ScopedSymbolTable::visible() const
+{
+  // every binding made is in the undo log, a symbol may be there many times
+  std::vector<std::pair<Symbol, VarBinding>> result;
+  std::vector<bool> seen(m_bindings.size(), false);
+  for(auto& entry : m_undo)
+  {
+    Symbol sym = entry.first;
+    if(!seen[sym] && m_bindings[sym])
+    {
+      seen[sym] = true;
+      result.emplace_back(sym, m_bindings[sym]);
+    }
+  }
+  return result;
+}